@@ -0,0 +1,703 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+#include "tramp.h"
+
+/* Micro-benchmarks for the trampoline allocators.  This is linked
+   against the objects directly rather than libtramp.so so that the
+   hidden page-pair interface is reachable.  */
+
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Page pair refill: the cost paid each time an allocator runs out.  */
+
+static void
+bench_pairs (long n)
+{
+  double t0, t1;
+  long i;
+
+  /* Take the one-time template setup out of the measurement.  */
+  __tramp_free_pair (__tramp_alloc_pair ());
+
+  t0 = now_ns ();
+  for (i = 0; i < n; ++i)
+    __tramp_free_pair (__tramp_alloc_pair ());
+  t1 = now_ns ();
+
+  printf ("pairs: %ld alloc+free, %.0f ns/pair\n", n, (t1 - t0) / n);
+}
+
+static long
+count_vmas (void)
+{
+  FILE *f = fopen ("/proc/self/maps", "r");
+  long n = 0;
+  int c;
+
+  if (f == NULL)
+    return -1;
+  while ((c = getc (f)) != EOF)
+    n += c == '\n';
+  fclose (f);
+  return n;
+}
+
+/* Stack trampolines: N frames, each allocating PER_FRAME of them, all
+   at the same CFA, so that each frame releases the previous one's.  */
+
+#define PER_FRAME	4
+
+static void __attribute__((noinline))
+bench_stack (long n)
+{
+  uintptr_t cfa = (uintptr_t) __builtin_dwarf_cfa ();
+  uintptr_t fns[PER_FRAME], chains[PER_FRAME];
+  void *t[PER_FRAME];
+  double t0, t1, t2;
+  long i;
+  int j;
+
+  for (j = 0; j < PER_FRAME; ++j)
+    {
+      fns[j] = (uintptr_t) bench_stack;
+      chains[j] = j;
+    }
+  __tramp_stack_alloc (cfa, (uintptr_t) bench_stack, 0);
+
+  t0 = now_ns ();
+  for (i = 0; i < n; ++i)
+    for (j = 0; j < PER_FRAME; ++j)
+      __tramp_stack_alloc (j ? 0 : cfa, fns[j], chains[j]);
+  t1 = now_ns ();
+  for (i = 0; i < n; ++i)
+    __tramp_stack_alloc_n (cfa, PER_FRAME, fns, chains, t);
+  t2 = now_ns ();
+
+  printf ("stack: %ld frames of %d, %.1f ns single, %.1f ns batched\n",
+	  n, PER_FRAME, (t1 - t0) / (n * PER_FRAME),
+	  (t2 - t1) / (n * PER_FRAME));
+}
+
+/* Stack trampolines from recursion DEPTH deep, N times over, so that
+   the log grows and shrinks across many pages each time.  */
+
+#define DEPTH	2000
+
+static void __attribute__((noinline))
+deep_frame (int depth)
+{
+  __tramp_stack_alloc ((uintptr_t) __builtin_dwarf_cfa (),
+		       (uintptr_t) deep_frame, depth);
+  if (depth > 0)
+    deep_frame (depth - 1);
+  asm volatile ("" ::: "memory");
+}
+
+static void
+bench_deep (long n)
+{
+  struct tramp_stats s0, s1;
+  double t0, t1;
+  long i;
+
+  deep_frame (DEPTH);
+  __tramp_get_stats (&s0);
+  t0 = now_ns ();
+  for (i = 0; i < n; ++i)
+    deep_frame (DEPTH);
+  t1 = now_ns ();
+  __tramp_get_stats (&s1);
+
+  printf ("deep: %ld x %d frames, %.1f ns/frame, %lu mmap, %lu munmap\n",
+	  n, DEPTH, (t1 - t0) / (n * DEPTH),
+	  s1.mmap_calls - s0.mmap_calls, s1.munmap_calls - s0.munmap_calls);
+}
+
+/* The first stack trampoline after a recursion of each depth returns,
+   which must release everything allocated by the frames within it.  */
+
+static void
+bench_unwind (long n)
+{
+  static const int depths[] = { 10, 100, 1000, 10000 };
+  uintptr_t cfa = (uintptr_t) __builtin_dwarf_cfa ();
+  double t0, sum;
+  long i, rounds;
+  size_t d;
+
+  for (d = 0; d < sizeof (depths) / sizeof (depths[0]); ++d)
+    {
+      rounds = n / depths[d] > 0 ? n / depths[d] : 1;
+      sum = 0;
+      for (i = 0; i < rounds; ++i)
+	{
+	  deep_frame (depths[d]);
+	  t0 = now_ns ();
+	  __tramp_stack_alloc (cfa, (uintptr_t) bench_unwind, 0);
+	  sum += now_ns () - t0;
+	}
+      printf ("unwind: %d frames, %.0f ns to release\n",
+	      depths[d], sum / rounds);
+    }
+}
+
+/* Heap trampolines: fill N, then free them all.  */
+
+static void
+bench_heap (long n)
+{
+  void **t = malloc (n * sizeof (void *));
+  long i, vmas;
+  double t0, t1, t2;
+
+  vmas = count_vmas ();
+
+  t0 = now_ns ();
+  for (i = 0; i < n; ++i)
+    t[i] = __tramp_heap_alloc ((uintptr_t) bench_heap, i);
+  t1 = now_ns ();
+
+  vmas = count_vmas () - vmas;
+
+  for (i = 0; i < n; ++i)
+    __tramp_heap_free (t[i]);
+  t2 = now_ns ();
+
+  printf ("heap: %ld live, %.0f ns/alloc, %.0f ns/free, %ld new VMAs\n",
+	  n, (t1 - t0) / n, (t2 - t1) / n, vmas);
+  free (t);
+}
+
+/* Heap trampolines on fragmented pages: fill N, free a random three
+   in four, then time each allocation that refills the holes.  */
+
+static void
+bench_frag (long n)
+{
+  void **t = malloc (n * sizeof (void *));
+  double t0, d, sum = 0, max = 0;
+  long i, nfree = 0;
+
+  for (i = 0; i < n; ++i)
+    t[i] = __tramp_heap_alloc ((uintptr_t) bench_frag, i);
+  srand (1);
+  for (i = 0; i < n; ++i)
+    if (rand () % 4 != 0)
+      {
+	__tramp_heap_free (t[i]);
+	t[i] = NULL;
+	nfree++;
+      }
+
+  for (i = 0; i < n; ++i)
+    if (t[i] == NULL)
+      {
+	t0 = now_ns ();
+	t[i] = __tramp_heap_alloc ((uintptr_t) bench_frag, i);
+	d = now_ns () - t0;
+	sum += d;
+	if (d > max)
+	  max = d;
+      }
+
+  for (i = 0; i < n; ++i)
+    __tramp_heap_free (t[i]);
+
+  printf ("frag: %ld refills, %.0f ns avg, %.0f ns max\n",
+	  nfree, sum / nfree, max);
+  free (t);
+}
+
+/* The latency of each of N heap allocations, and then of each free,
+   to see what refilling and releasing page pairs costs at the tail.
+   Compare with TRAMP_TUNABLES=refill_pairs=N.  */
+
+static int
+cmp_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static void
+bench_tail (long n)
+{
+  void **t = malloc (n * sizeof (void *));
+  double *d = malloc (n * sizeof (double));
+  double t0;
+  long i;
+  int pass;
+
+  for (pass = 0; pass < 2; ++pass)
+    {
+      for (i = 0; i < n; ++i)
+	{
+	  t0 = now_ns ();
+	  if (pass == 0)
+	    t[i] = __tramp_heap_alloc ((uintptr_t) bench_tail, i);
+	  else
+	    __tramp_heap_free (t[i]);
+	  d[i] = now_ns () - t0;
+	}
+      qsort (d, n, sizeof (double), cmp_double);
+      printf ("tail: %ld %s, %.0f ns p50, %.0f ns p99.9, %.0f ns max\n",
+	      n, pass ? "frees" : "allocs", d[n / 2], d[n - 1 - n / 1000],
+	      d[n - 1]);
+    }
+
+  free (d);
+  free (t);
+}
+
+/* Heap trampolines under churn: allocate N, of which one in 16 lives
+   on and the rest are freed after the next WINDOW allocations.  At the
+   end, see how much memory is left holding the survivors.  */
+
+static long
+rss_kb (void)
+{
+  FILE *f = fopen ("/proc/self/statm", "r");
+  long size, rss = -1;
+
+  if (f == NULL)
+    return -1;
+  if (fscanf (f, "%ld %ld", &size, &rss) != 2)
+    rss = -1;
+  fclose (f);
+  return rss * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+#define WINDOW	8192
+
+static void
+bench_churn (long n)
+{
+  void **keep = malloc (n / 16 * sizeof (void *));
+  void *ring[WINDOW] = { NULL };
+  struct tramp_stats st;
+  long i, nkeep = 0;
+  double t0, t1;
+
+  srand (1);
+  t0 = now_ns ();
+  for (i = 0; i < n; ++i)
+    {
+      void *t = __tramp_heap_alloc ((uintptr_t) bench_churn, i);
+      if (rand () % 16 == 0 && nkeep < n / 16)
+	keep[nkeep++] = t;
+      else
+	{
+	  long j = rand () % WINDOW;
+	  if (ring[j])
+	    __tramp_heap_free (ring[j]);
+	  ring[j] = t;
+	}
+    }
+  for (i = 0; i < WINDOW; ++i)
+    if (ring[i])
+      __tramp_heap_free (ring[i]);
+  t1 = now_ns ();
+
+  __tramp_get_stats (&st);
+  printf ("churn: %ld survivors of %ld, %lu heap pages, %ld KiB rss, "
+	  "%.0f ns/op\n", nkeep, n, st.heap_pages, rss_kb (),
+	  (t1 - t0) / n);
+
+  for (i = 0; i < nkeep; ++i)
+    __tramp_heap_free (keep[i]);
+  free (keep);
+}
+
+/* Heap trampolines from several threads at once, each allocating and
+   freeing BATCH at a time.  */
+
+#define BATCH	64
+
+static void *
+heapmt_thread (void *arg)
+{
+  long i, j, n = *(long *) arg;
+  void *t[BATCH];
+
+  for (i = 0; i < n; i += BATCH)
+    {
+      for (j = 0; j < BATCH; ++j)
+	t[j] = __tramp_heap_alloc ((uintptr_t) heapmt_thread, j);
+      for (j = 0; j < BATCH; ++j)
+	__tramp_heap_free (t[j]);
+    }
+  return NULL;
+}
+
+static void
+bench_heapmt (long n, int nthreads)
+{
+  pthread_t th[nthreads];
+  double t0, t1;
+  int i;
+
+  t0 = now_ns ();
+  for (i = 0; i < nthreads; ++i)
+    pthread_create (&th[i], NULL, heapmt_thread, &n);
+  for (i = 0; i < nthreads; ++i)
+    pthread_join (th[i], NULL);
+  t1 = now_ns ();
+
+  printf ("heapmt: %d threads x %ld alloc+free, %.1f M/s\n",
+	  nthreads, n, nthreads * n / (t1 - t0) * 1e3);
+}
+
+/* Heap trampolines BATCH at a time, one call each or one call for all.  */
+
+static void
+bench_batch (long n)
+{
+  uintptr_t fns[BATCH], chains[BATCH];
+  void *t[BATCH];
+  double t0, t1, t2;
+  long i;
+  int j;
+
+  for (j = 0; j < BATCH; ++j)
+    {
+      fns[j] = (uintptr_t) bench_batch;
+      chains[j] = j;
+    }
+
+  t0 = now_ns ();
+  for (i = 0; i < n; i += BATCH)
+    {
+      for (j = 0; j < BATCH; ++j)
+	t[j] = __tramp_heap_alloc (fns[j], chains[j]);
+      for (j = 0; j < BATCH; ++j)
+	__tramp_heap_free (t[j]);
+    }
+  t1 = now_ns ();
+  for (i = 0; i < n; i += BATCH)
+    {
+      __tramp_heap_alloc_n (BATCH, fns, chains, t);
+      __tramp_heap_free_n (BATCH, t);
+    }
+  t2 = now_ns ();
+
+  printf ("batch: %ld alloc+free by %d, %.1f ns single, %.1f ns batched\n",
+	  n, BATCH, (t1 - t0) / n, (t2 - t1) / n);
+}
+
+/* N heap trampolines held at once, for only DISTINCT different pairs,
+   allocated each time or interned.  */
+
+#define DISTINCT	16
+
+static void
+bench_intern (long n)
+{
+  void **t = malloc (n * sizeof (void *));
+  struct tramp_stats st;
+  unsigned long pages[2];
+  double t0, t1, ns[2];
+  long i;
+  int pass;
+
+  for (pass = 0; pass < 2; ++pass)
+    {
+      t0 = now_ns ();
+      for (i = 0; i < n; ++i)
+	t[i] = (pass ? __tramp_heap_intern : __tramp_heap_alloc)
+	  ((uintptr_t) bench_intern, i % DISTINCT);
+      t1 = now_ns ();
+      __tramp_get_stats (&st);
+      pages[pass] = st.heap_pages;
+      ns[pass] = (t1 - t0) / n;
+      for (i = 0; i < n; ++i)
+	__tramp_heap_free (t[i]);
+    }
+
+  printf ("intern: %ld of %d pairs, %.1f ns %lu pages allocated, "
+	  "%.1f ns %lu pages interned\n",
+	  n, DISTINCT, ns[0], pages[0], ns[1], pages[1]);
+  free (t);
+}
+
+/* Call-through latency of heap trampolines allocated by a thread on one
+   NUMA node and called by a thread on another, for each pair of nodes.
+   Each thread is pinned to the first cpu of its node.  */
+
+#define NUMA_TRAMPS	4096
+
+struct numa_arg
+{
+  int cpu;
+  long n;
+  void **t;
+  double ns;
+};
+
+static int
+node_cpu (int node)
+{
+  char name[64];
+  FILE *f;
+  int cpu = -1;
+
+  snprintf (name, sizeof (name),
+	    "/sys/devices/system/node/node%d/cpulist", node);
+  f = fopen (name, "r");
+  if (f == NULL)
+    return -1;
+  if (fscanf (f, "%d", &cpu) != 1)
+    cpu = -1;
+  fclose (f);
+  return cpu;
+}
+
+static void
+pin (int cpu)
+{
+  cpu_set_t set;
+
+  CPU_ZERO (&set);
+  CPU_SET (cpu, &set);
+  pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+}
+
+static void
+numa_target (void)
+{
+}
+
+static void *
+numa_alloc_thread (void *arg)
+{
+  struct numa_arg *a = arg;
+  long i;
+
+  pin (a->cpu);
+  for (i = 0; i < NUMA_TRAMPS; ++i)
+    a->t[i] = __tramp_heap_alloc ((uintptr_t) numa_target, i);
+  return NULL;
+}
+
+static void *
+numa_call_thread (void *arg)
+{
+  struct numa_arg *a = arg;
+  double t0;
+  long i;
+
+  pin (a->cpu);
+  t0 = now_ns ();
+  for (i = 0; i < a->n; ++i)
+    ((void (*) (void)) a->t[(i * 997) % NUMA_TRAMPS]) ();
+  a->ns = (now_ns () - t0) / a->n;
+  return NULL;
+}
+
+static void
+bench_numa (long n)
+{
+  void *t[NUMA_TRAMPS];
+  struct numa_arg a = { .n = n, .t = t };
+  int from, to, nodes;
+  pthread_t th;
+  long i;
+
+  for (nodes = 0; node_cpu (nodes) >= 0; ++nodes)
+    continue;
+  if (nodes == 0)
+    {
+      printf ("numa: no nodes found\n");
+      return;
+    }
+
+  for (from = 0; from < nodes; ++from)
+    {
+      a.cpu = node_cpu (from);
+      pthread_create (&th, NULL, numa_alloc_thread, &a);
+      pthread_join (th, NULL);
+
+      for (to = 0; to < nodes; ++to)
+	{
+	  a.cpu = node_cpu (to);
+	  pthread_create (&th, NULL, numa_call_thread, &a);
+	  pthread_join (th, NULL);
+	  printf ("numa: alloc on node %d, call on node %d, %.1f ns/call\n",
+		  from, to, a.ns);
+	}
+
+      for (i = 0; i < NUMA_TRAMPS; ++i)
+	__tramp_heap_free (t[i]);
+    }
+}
+
+/* The first stack trampoline of each new thread, which must find a page
+   pair and a log, and whatever it costs to give them back when the
+   thread exits.  */
+
+static void *
+first_thread (void *arg)
+{
+  double t0 = now_ns ();
+  __tramp_stack_alloc ((uintptr_t) __builtin_dwarf_cfa (),
+		       (uintptr_t) first_thread, 0);
+  *(double *) arg = now_ns () - t0;
+  return NULL;
+}
+
+static void
+bench_first (long n)
+{
+  struct tramp_stats s0, s1;
+  double t, sum = 0, max = 0;
+  pthread_t th;
+  long i;
+
+  __tramp_get_stats (&s0);
+  for (i = 0; i < n; ++i)
+    {
+      pthread_create (&th, NULL, first_thread, &t);
+      pthread_join (th, NULL);
+      sum += t;
+      if (t > max)
+	max = t;
+    }
+  __tramp_get_stats (&s1);
+
+  printf ("first: %ld threads, %.0f ns avg, %.0f ns max, %lu mmap, "
+	  "%lu munmap\n", n, sum / n, max,
+	  s1.mmap_calls - s0.mmap_calls, s1.munmap_calls - s0.munmap_calls);
+}
+
+/* Stack trampolines allocated by a signal handler on the signal stack,
+   enough to need more than one page pair, with the thread allocating
+   in between as it would.  */
+
+#define SIGNAL_TRAMPS	300
+
+static double signal_sum, signal_max;
+
+static void
+signal_handler (int sig __attribute__((unused)))
+{
+  static uintptr_t fns[SIGNAL_TRAMPS], chains[SIGNAL_TRAMPS];
+  void *out[SIGNAL_TRAMPS];
+  double t0 = now_ns (), t;
+
+  __tramp_stack_alloc_n ((uintptr_t) __builtin_dwarf_cfa (), SIGNAL_TRAMPS,
+			 fns, chains, out);
+  t = now_ns () - t0;
+  signal_sum += t;
+  if (t > signal_max)
+    signal_max = t;
+}
+
+static void
+bench_signal (long n)
+{
+  static char altstack[64 * 1024];
+  stack_t ss = { .ss_sp = altstack, .ss_size = sizeof (altstack) };
+  struct sigaction sa = { .sa_handler = signal_handler,
+			  .sa_flags = SA_ONSTACK };
+  struct tramp_stats s0, s1;
+  long i;
+
+  sigaltstack (&ss, NULL);
+  sigaction (SIGUSR1, &sa, NULL);
+  __tramp_stack_alloc ((uintptr_t) __builtin_dwarf_cfa (),
+		       (uintptr_t) bench_signal, 0);
+  raise (SIGUSR1);
+
+  signal_sum = signal_max = 0;
+  __tramp_get_stats (&s0);
+  for (i = 0; i < n; ++i)
+    {
+      raise (SIGUSR1);
+      __tramp_stack_alloc ((uintptr_t) __builtin_dwarf_cfa (),
+			   (uintptr_t) bench_signal, i);
+    }
+  __tramp_get_stats (&s1);
+
+  printf ("signal: %ld x %d in handler, %.0f ns avg, %.0f ns max, "
+	  "%lu mmap, %lu munmap\n", n, SIGNAL_TRAMPS, signal_sum / n,
+	  signal_max, s1.mmap_calls - s0.mmap_calls,
+	  s1.munmap_calls - s0.munmap_calls);
+
+  signal (SIGUSR1, SIG_DFL);
+  ss.ss_flags = SS_DISABLE;
+  sigaltstack (&ss, NULL);
+}
+
+/* Print what __tramp_get_stats has to say about everything run so far.  */
+
+static void
+print_stats (void)
+{
+  struct tramp_stats st;
+
+  __tramp_get_stats (&st);
+  printf ("stats: live %lu heap, %lu stack; mapped %lu pairs, %lu logs\n"
+	  "stats: %lu mmap, %lu munmap, %lu replayed\n"
+	  "stats: save_page %lu/%lu\n"
+	  "stats: intern %lu/%lu\n"
+	  "stats: lock %lu taken, %lu waited, %lu ns\n",
+	  st.heap_live, st.stack_live, st.pairs_mapped, st.log_pages_mapped,
+	  st.mmap_calls, st.munmap_calls, st.replay_entries,
+	  st.save_page_hits, st.save_page_lookups,
+	  st.intern_hits, st.intern_lookups,
+	  st.lock_acquires, st.lock_waits, st.lock_wait_ns);
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *which = argc > 1 ? argv[1] : "all";
+  long n = argc > 2 ? atol (argv[2]) : 100000;
+  int nthreads = argc > 3 ? atoi (argv[3]) : 4;
+  bool all = strcmp (which, "all") == 0;
+
+  if (all || strcmp (which, "pairs") == 0)
+    bench_pairs (n);
+  if (all || strcmp (which, "stack") == 0)
+    bench_stack (n);
+  if (all || strcmp (which, "deep") == 0)
+    bench_deep (all ? 1000 : n);
+  if (all || strcmp (which, "unwind") == 0)
+    bench_unwind (n);
+  if (all || strcmp (which, "heap") == 0)
+    bench_heap (n);
+  if (all || strcmp (which, "frag") == 0)
+    bench_frag (n);
+  if (all || strcmp (which, "tail") == 0)
+    bench_tail (n);
+  if (all || strcmp (which, "churn") == 0)
+    bench_churn (n);
+  if (all || strcmp (which, "heapmt") == 0)
+    bench_heapmt (n, nthreads);
+  if (all || strcmp (which, "batch") == 0)
+    bench_batch (n);
+  if (all || strcmp (which, "intern") == 0)
+    bench_intern (n);
+  if (all || strcmp (which, "numa") == 0)
+    bench_numa (n);
+  if (all || strcmp (which, "first") == 0)
+    bench_first (all ? 100 : n);
+  if (all || strcmp (which, "signal") == 0)
+    bench_signal (all ? 10000 : n);
+  if (all || strcmp (which, "stats") == 0)
+    print_stats ();
+
+  return 0;
+}
@@ -1,6 +1,41 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <setjmp.h>
 
 void * __tramp_stack_alloc (void *cfa, void *fnaddr, void *chain_value);
+void __tramp_stack_alloc_n (void *cfa, unsigned long n, void *const *fns,
+			    void *const *chains, void **out);
+void * __tramp_heap_alloc (void *fnaddr, void *chain_value);
+void __tramp_heap_free (void *tramp);
+void __tramp_heap_alloc_n (unsigned long n, void *const *fns,
+			   void *const *chains, void **out);
+void __tramp_heap_free_n (unsigned long n, void *const *tramps);
+int __tramp_heap_trim (unsigned long keep);
+int __tramp_register_stack (void *lo, void *hi);
+int __tramp_unregister_stack (void *lo);
+void __tramp_stack_release (void *cfa);
+struct tramp_ctx;
+struct tramp_ctx *__tramp_ctx_create (void *lo, void *hi);
+int __tramp_ctx_switch (struct tramp_ctx *ctx, struct tramp_ctx **old);
+void __tramp_ctx_destroy (struct tramp_ctx *ctx);
+void * __tramp_heap_intern (void *fnaddr, void *chain_value);
+
+/* As in tramp.h, which declares the allocators above differently.  */
+struct tramp_stats
+{
+  unsigned long heap_live, stack_live, heap_pages;
+  unsigned long pairs_mapped, log_pages_mapped;
+  unsigned long mmap_calls, munmap_calls;
+  unsigned long save_page_lookups, save_page_hits, replay_entries;
+  unsigned long intern_lookups, intern_hits;
+  unsigned long lock_acquires, lock_waits, lock_wait_ns;
+};
+void __tramp_get_stats (struct tramp_stats *stats);
 
 extern char bounce[];
 
@@ -14,6 +49,501 @@ asm("bounce: mov r0, r12; mov pc, lr");
 # error unsupported
 #endif
 
+/* Enough heap trampolines to span several page pairs.  */
+#define NHEAP 5000
+
+static void *t[NHEAP], *fns[NHEAP], *chains[NHEAP];
+
+/* Free from another thread, into pages it doesn't own.  */
+static void *free_odd (void *arg)
+{
+  int i;
+  for (i = 1; i < NHEAP; i += 2)
+    __tramp_heap_free (t[i]);
+  return arg;
+}
+
+static int test_heap (void)
+{
+  pthread_t th;
+  int i, ret = 0;
+
+  for (i = 0; i < NHEAP; ++i)
+    t[i] = __tramp_heap_alloc (bounce, (void *)(intptr_t)i);
+  for (i = 0; i < NHEAP; ++i)
+    ret |= ((intptr_t (*)(void)) t[i]) () != i;
+
+  pthread_create (&th, NULL, free_odd, NULL);
+  pthread_join (th, NULL);
+  for (i = 1; i < NHEAP; i += 2)
+    t[i] = __tramp_heap_alloc (bounce, (void *)(intptr_t)-i);
+  for (i = 0; i < NHEAP; ++i)
+    ret |= ((intptr_t (*)(void)) t[i]) () != (i & 1 ? -i : i);
+
+  for (i = 0; i < NHEAP; ++i)
+    __tramp_heap_free (t[i]);
+
+  /* Once trimmed, there is nothing more to trim.  */
+  __tramp_heap_trim (0);
+  ret |= __tramp_heap_trim (0) != 0;
+
+  /* The same again in one batch.  */
+  for (i = 0; i < NHEAP; ++i)
+    {
+      fns[i] = bounce;
+      chains[i] = (void *)(intptr_t)i;
+    }
+  __tramp_heap_alloc_n (NHEAP, fns, chains, t);
+  for (i = 0; i < NHEAP; ++i)
+    ret |= ((intptr_t (*)(void)) t[i]) () != i;
+  __tramp_heap_free_n (NHEAP, t);
+
+  /* Interned trampolines are shared, and live until the last free.  */
+  t[0] = __tramp_heap_intern (bounce, (void *)(intptr_t)42);
+  t[1] = __tramp_heap_intern (bounce, (void *)(intptr_t)42);
+  t[2] = __tramp_heap_alloc (bounce, (void *)(intptr_t)42);
+  ret |= t[0] != t[1] || t[0] == t[2];
+  __tramp_heap_free (t[2]);
+  __tramp_heap_free (t[0]);
+  ret |= ((intptr_t (*)(void)) t[1]) () != 42;
+  __tramp_heap_free (t[1]);
+
+  return ret;
+}
+
+/* Enough stack trampolines in one frame to span page pairs.  */
+static int __attribute__((noinline)) test_stack_n (void)
+{
+  int i, ret = 0;
+
+  for (i = 0; i < NHEAP; ++i)
+    {
+      fns[i] = bounce;
+      chains[i] = (void *)(intptr_t)i;
+    }
+  __tramp_stack_alloc_n (__builtin_dwarf_cfa (), NHEAP, fns, chains, t);
+  for (i = 0; i < NHEAP; ++i)
+    ret |= ((intptr_t (*)(void)) t[i]) () != i;
+  return ret;
+}
+
+/* Stack trampolines from a deep recursion, each frame allocating again
+   once the frames within it return, so the log is cut at every depth
+   and the pages past the cut released.  */
+static int __attribute__((noinline)) unwind_frame (int depth)
+{
+  void *cfa = __builtin_dwarf_cfa ();
+  void *t1 = __tramp_stack_alloc (cfa, bounce, (void *)(intptr_t)depth);
+  void *t2;
+  int ret = 0;
+
+  if (depth > 0)
+    ret = unwind_frame (depth - 1);
+  ret |= ((intptr_t (*)(void)) t1) () != depth;
+  t2 = __tramp_stack_alloc (cfa, bounce, (void *)(intptr_t)-depth);
+  ret |= ((intptr_t (*)(void)) t2) () != -depth;
+  asm volatile ("" ::: "memory");
+  return ret;
+}
+
+static int test_unwind (void)
+{
+  return unwind_frame (3000) | unwind_frame (10);
+}
+
+/* Stack trampolines from a signal handler that may interrupt the
+   allocator, checked against those of the frame it interrupted.  */
+static volatile int signal_bad;
+
+static void handler (int sig)
+{
+  void *t = __tramp_stack_alloc (__builtin_dwarf_cfa (), bounce,
+				 (void *)(intptr_t)sig);
+  signal_bad |= ((intptr_t (*)(void)) t) () != sig;
+}
+
+static int __attribute__((noinline)) signal_frame (int i)
+{
+  void *t[4];
+  int j, ret = 0;
+
+  for (j = 0; j < 4; ++j)
+    t[j] = __tramp_stack_alloc (j ? 0 : __builtin_dwarf_cfa (), bounce,
+				(void *)(intptr_t)(i + j));
+  for (j = 0; j < 4; ++j)
+    ret |= ((intptr_t (*)(void)) t[j]) () != i + j;
+  return ret;
+}
+
+static int test_signal (int flags)
+{
+  struct itimerval it = { { 0, 20 }, { 0, 20 } };
+  struct sigaction sa;
+  int i, ret = 0;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = handler;
+  sa.sa_flags = flags;
+  sigaction (SIGALRM, &sa, NULL);
+  setitimer (ITIMER_REAL, &it, NULL);
+  for (i = 0; i < 200000; ++i)
+    ret |= signal_frame (i);
+  memset (&it, 0, sizeof (it));
+  setitimer (ITIMER_REAL, &it, NULL);
+
+  return ret | signal_bad;
+}
+
+/* The same again with a handler that jumps out of whatever it
+   interrupted, which may be the allocator.  Allocations go on as
+   before afterwards, each frame releasing those of the last, and once
+   all of them are released the count of live ones is as it was.  */
+static sigjmp_buf jump_jb;
+
+static void jump_handler (int sig)
+{
+  handler (sig);
+  siglongjmp (jump_jb, 1);
+}
+
+static int test_signal_jump (void)
+{
+  struct itimerval it = { { 0, 20 }, { 0, 20 } };
+  struct tramp_stats s0, s1;
+  struct sigaction sa;
+  volatile int i;
+  int ret = 0;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = jump_handler;
+  sigaction (SIGALRM, &sa, NULL);
+  __tramp_stack_release (__builtin_frame_address (0));
+  __tramp_get_stats (&s0);
+  i = 0;
+  if (sigsetjmp (jump_jb, 1) == 0)
+    setitimer (ITIMER_REAL, &it, NULL);
+  for (; i < 100000; ++i)
+    if (sigsetjmp (jump_jb, 1) == 0)
+      signal_bad |= signal_frame (i);
+  memset (&it, 0, sizeof (it));
+  setitimer (ITIMER_REAL, &it, NULL);
+
+  for (i = 0; i < 100000; ++i)
+    ret |= signal_frame (i);
+  __tramp_stack_release (__builtin_frame_address (0));
+  __tramp_get_stats (&s1);
+  return ret | signal_bad | (s1.stack_live != s0.stack_live);
+}
+
+/* The same again on a signal stack.  */
+/* Handlers on a signal stack installed after the first allocation
+   should find a reserve already primed, and so make no system calls,
+   unless TRAMP_TUNABLES turned the reserve off.  */
+static int test_sigaltstack (void)
+{
+  static char altstack[65536];
+  stack_t ss = { .ss_sp = altstack, .ss_size = sizeof (altstack) };
+  const char *tunables = getenv ("TRAMP_TUNABLES");
+  struct tramp_stats s0, s1;
+  int i, ret = 0;
+
+  sigaltstack (&ss, NULL);
+  for (i = 0; i < 4096; ++i)
+    ret |= signal_frame (i);
+  __tramp_get_stats (&s0);
+  ret |= test_signal (SA_ONSTACK);
+  __tramp_get_stats (&s1);
+  if (tunables && strstr (tunables, "signal_pairs=0"))
+    return ret;
+  return ret | (s1.mmap_calls != s0.mmap_calls);
+}
+
+/* Stack trampolines from a handler that interrupts heap allocation,
+   each time enough to need fresh page pairs, which the heap may be
+   taking or giving back at that moment.  Every other round it runs on
+   the signal stack, using up the reserve for the handler off it to
+   refill.  */
+static void heap_handler (int sig)
+{
+  void *cfa = __builtin_dwarf_cfa ();
+  void *t;
+  int i;
+
+  for (i = 0; i < 2000; ++i)
+    {
+      t = __tramp_stack_alloc (i ? 0 : cfa, bounce, (void *)(intptr_t)i);
+      signal_bad |= ((intptr_t (*)(void)) t) () != i;
+    }
+}
+
+static int test_signal_heap (void)
+{
+  struct itimerval it = { { 0, 200 }, { 0, 200 } };
+  struct sigaction sa;
+  int i, j, ret = 0;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = heap_handler;
+  sigaction (SIGALRM, &sa, NULL);
+  setitimer (ITIMER_REAL, &it, NULL);
+  for (i = 0; i < 200; ++i)
+    {
+      sa.sa_flags = (i & 1 ? SA_ONSTACK : 0);
+      sigaction (SIGALRM, &sa, NULL);
+      for (j = 0; j < NHEAP; ++j)
+	t[j] = __tramp_heap_alloc (bounce, (void *)(intptr_t)j);
+      for (j = 0; j < NHEAP; ++j)
+	ret |= ((intptr_t (*)(void)) t[j]) () != j;
+      for (j = 0; j < NHEAP; ++j)
+	__tramp_heap_free (t[j]);
+    }
+  memset (&it, 0, sizeof (it));
+  setitimer (ITIMER_REAL, &it, NULL);
+
+  return ret | signal_bad;
+}
+
+/* Stack trampolines released at once after a longjmp out of a deep
+   recursion, leaving only those of the frame it returned to live.  */
+static jmp_buf release_jb;
+
+static void __attribute__((noinline)) release_frame (int depth)
+{
+  __tramp_stack_alloc (__builtin_dwarf_cfa (), bounce,
+		       (void *)(intptr_t)depth);
+  if (depth > 0)
+    release_frame (depth - 1);
+  longjmp (release_jb, 1);
+}
+
+static int __attribute__((noinline)) test_release (void)
+{
+  void *volatile t1 = __tramp_stack_alloc (__builtin_dwarf_cfa (), bounce,
+					   (void *)1);
+  struct tramp_stats s0, s1;
+  void *t2;
+
+  __tramp_get_stats (&s0);
+  if (setjmp (release_jb) == 0)
+    release_frame (2000);
+  __tramp_stack_release (__builtin_frame_address (0));
+  __tramp_get_stats (&s1);
+  t2 = __tramp_stack_alloc (0, bounce, (void *)2);
+  return (t2 == t1) | (((intptr_t (*)(void)) t1) () != 1)
+	 | (((intptr_t (*)(void)) t2) () != 2)
+	 | (s1.stack_live != s0.stack_live);
+}
+
+/* Stack trampolines from threads that exit without freeing them, each
+   starting with what the last one left, so that none after the first
+   maps anything.  */
+static void *thread_frame (void *arg)
+{
+  void *t = __tramp_stack_alloc (__builtin_dwarf_cfa (), bounce, arg);
+
+  return (void *)(intptr_t)(((intptr_t (*)(void)) t) () != (intptr_t)arg);
+}
+
+static int test_threads (void)
+{
+  struct tramp_stats s0, s1;
+  pthread_t th;
+  void *bad;
+  int i, ret = 0;
+
+  for (i = 0; i < 16; ++i)
+    {
+      pthread_create (&th, NULL, thread_frame, (void *)(intptr_t)i);
+      pthread_join (th, &bad);
+      ret |= bad != NULL;
+      if (i == 0)
+	__tramp_get_stats (&s0);
+    }
+  __tramp_get_stats (&s1);
+  return ret | (s1.pairs_mapped != s0.pairs_mapped)
+	 | (s1.mmap_calls != s0.mmap_calls);
+}
+
+/* Stack trampolines in a new thread, first far down its stack and then
+   near the top, which must know the whole stack to see that the first
+   frame is gone.  */
+static void __attribute__((noinline)) deep_frame (int depth)
+{
+  volatile char pad[65536];
+
+  pad[0] = depth;
+  if (depth > 0)
+    deep_frame (depth - 1);
+  else
+    __tramp_stack_alloc (__builtin_dwarf_cfa (), bounce, 0);
+  pad[1] = depth;
+}
+
+static void *thread_deep (void *arg)
+{
+  struct tramp_stats s0, s1;
+  void *t;
+
+  __tramp_get_stats (&s0);
+  deep_frame (32);
+  t = __tramp_stack_alloc (__builtin_dwarf_cfa (), bounce, arg);
+  __tramp_get_stats (&s1);
+  return (void *)(intptr_t)((((intptr_t (*)(void)) t) () != (intptr_t)arg)
+			    | (s1.stack_live != s0.stack_live + 1));
+}
+
+static int test_thread_stack (void)
+{
+  pthread_t th;
+  void *bad;
+
+  pthread_create (&th, NULL, thread_deep, (void *)1);
+  pthread_join (th, &bad);
+  return bad != NULL;
+}
+
+/* Stack trampolines on two registered stacks, the second entered from
+   the first but at a higher address, so that only the registry can tell
+   that its frames are the newer.  */
+static char seg_stacks[2][65536] __attribute__((aligned (16)));
+static ucontext_t seg_uc[3];
+static volatile int seg_bad;
+
+static void seg_inner (void)
+{
+  void *t = __tramp_stack_alloc (__builtin_dwarf_cfa (), bounce, (void *)2);
+
+  seg_bad |= ((intptr_t (*)(void)) t) () != 2;
+}
+
+static void seg_outer (void)
+{
+  void *t = __tramp_stack_alloc (__builtin_dwarf_cfa (), bounce, (void *)1);
+
+  seg_bad |= __tramp_register_stack (seg_stacks[1], seg_stacks[2]) != 0;
+  swapcontext (&seg_uc[1], &seg_uc[2]);
+  seg_bad |= __tramp_unregister_stack (seg_stacks[1]) != 0;
+  seg_bad |= ((intptr_t (*)(void)) t) () != 1;
+}
+
+static int test_segments (void)
+{
+  void *t = __tramp_stack_alloc (__builtin_dwarf_cfa (), bounce, (void *)3);
+  int i;
+
+  for (i = 1; i < 3; ++i)
+    {
+      getcontext (&seg_uc[i]);
+      seg_uc[i].uc_stack.ss_sp = seg_stacks[i - 1];
+      seg_uc[i].uc_stack.ss_size = sizeof (seg_stacks[i - 1]);
+      seg_uc[i].uc_link = &seg_uc[i - 1];
+      makecontext (&seg_uc[i], i == 1 ? seg_outer : seg_inner, 0);
+    }
+
+  seg_bad |= __tramp_register_stack (seg_stacks[0], seg_stacks[1]) != 0;
+  swapcontext (&seg_uc[0], &seg_uc[1]);
+  seg_bad |= __tramp_unregister_stack (seg_stacks[0]) != 0;
+  return seg_bad | (((intptr_t (*)(void)) t) () != 3);
+}
+
+/* Stack trampolines from two fibers that take turns, each in a context
+   of its own.  The first's stack is lower, so that in one log its frames
+   would all look the newer.  The second's bounds are not given.  */
+static char fib_stacks[2][65536] __attribute__((aligned (16)));
+static struct tramp_ctx *fib_ctx[2];
+static ucontext_t fib_uc[3];
+static volatile int fib_bad;
+
+static void fib_yield (int id)
+{
+  fib_bad |= __tramp_ctx_switch (fib_ctx[!id], NULL) != 0;
+  swapcontext (&fib_uc[1 + id], &fib_uc[2 - id]);
+}
+
+static void __attribute__((noinline)) fib_step (int id, int i)
+{
+  void *t = __tramp_stack_alloc (__builtin_dwarf_cfa (), bounce,
+				 (void *)(intptr_t)(id * 1000 + i));
+
+  fib_yield (id);
+  fib_bad |= ((intptr_t (*)(void)) t) () != id * 1000 + i;
+}
+
+static void fib_body (int id)
+{
+  int i;
+
+  for (i = 0; i < 100; ++i)
+    fib_step (id, i);
+}
+
+static int test_fibers (void)
+{
+  int i;
+
+  for (i = 0; i < 2; ++i)
+    {
+      fib_ctx[i] = (i ? __tramp_ctx_create (NULL, NULL)
+		    : __tramp_ctx_create (fib_stacks[i], fib_stacks[i + 1]));
+      getcontext (&fib_uc[1 + i]);
+      fib_uc[1 + i].uc_stack.ss_sp = fib_stacks[i];
+      fib_uc[1 + i].uc_stack.ss_size = sizeof (fib_stacks[i]);
+      fib_uc[1 + i].uc_link = &fib_uc[0];
+      makecontext (&fib_uc[1 + i], (void (*)(void)) fib_body, 1, i);
+    }
+
+  /* The first fiber finishes while the second waits in its last step.  */
+  fib_bad |= __tramp_ctx_switch (fib_ctx[0], NULL) != 0;
+  swapcontext (&fib_uc[0], &fib_uc[1]);
+  fib_bad |= __tramp_ctx_switch (fib_ctx[1], NULL) != 0;
+  swapcontext (&fib_uc[0], &fib_uc[2]);
+  fib_bad |= __tramp_ctx_switch (NULL, NULL) != 0;
+
+  for (i = 0; i < 2; ++i)
+    __tramp_ctx_destroy (fib_ctx[i]);
+  return fib_bad;
+}
+
+/* A handler switching contexts and back, which is refused while it has
+   interrupted an allocation, and must then leave that to finish in the
+   context it started in.  */
+static struct tramp_ctx *sig_ctx;
+static volatile int ctx_refused;
+
+static void ctx_handler (int sig)
+{
+  struct tramp_ctx *old, *prev;
+
+  if (__tramp_ctx_switch (sig_ctx, &old) != 0)
+    {
+      ctx_refused++;
+      return;
+    }
+  signal_bad |= old != NULL;
+  signal_bad |= __tramp_ctx_switch (old, &prev) != 0 || prev != sig_ctx;
+  handler (sig);
+}
+
+static int test_signal_ctx (void)
+{
+  struct itimerval it = { { 0, 20 }, { 0, 20 } };
+  struct sigaction sa;
+  int i, ret = 0;
+
+  sig_ctx = __tramp_ctx_create (fib_stacks[0], fib_stacks[1]);
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = ctx_handler;
+  sigaction (SIGALRM, &sa, NULL);
+  setitimer (ITIMER_REAL, &it, NULL);
+  for (i = 0; i < 200000; ++i)
+    ret |= signal_frame (i);
+  memset (&it, 0, sizeof (it));
+  setitimer (ITIMER_REAL, &it, NULL);
+  __tramp_ctx_destroy (sig_ctx);
+
+  return ret | signal_bad | (ctx_refused == 0);
+}
+
 int main()
 {
   intptr_t test = (intptr_t)0x1122334455667788ULL;
@@ -21,5 +551,9 @@ int main()
   intptr_t (*tf)(void) = (intptr_t (*)(void)) t;
 
   intptr_t l = tf();
-  return l != test;
+  return (l != test) | test_heap () | test_stack_n () | test_unwind ()
+	  | test_segments () | test_threads () | test_thread_stack ()
+	  | test_release () | test_fibers () | test_signal_ctx ()
+	  | test_signal (0)
+	  | test_signal_jump () | test_sigaltstack () | test_signal_heap ();
 }
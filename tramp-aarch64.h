@@ -1,17 +1,20 @@
 #define PAGE_SIZE		65536
 #define TRAMP_SIZE		16
 #define TRAMP_RESERVE		0
+#define TRAMP_SLAB_PAGES	8
+#define TRAMP_MIN_PAGE_SIZE	4096
+#define TRAMP_PAGE_SIZES(X)	X(4096) X(16384) X(65536)
 
-#define TRAMP_ASM_STRING					\
-"	.pushsection .text.tramp_page,\"ax\",@progbits\n"	\
+#define TRAMP_ASM_STRING_N(NAME, DIST)				\
+"	.pushsection .text." NAME ",\"ax\",@progbits\n"		\
 "	.balign	65536\n"					\
-"tramp_page:\n"							\
+NAME ":\n"							\
 ".rept	4096\n"							\
 "	.balign	16\n"						\
-"1:	ldr	x17, 1b+0x10000\n"				\
-"	ldr	x18, 1b+0x10008\n"				\
+"1:	ldr	x17, 1b+" DIST "\n"				\
+"	ldr	x18, 1b+" DIST "+8\n"				\
 "	br	x17\n"						\
 ".endr\n"							\
-"	.size tramp_page, 65536\n"				\
-"	.type tramp_page, %function\n"				\
+"	.size " NAME ", 65536\n"				\
+"	.type " NAME ", %function\n"				\
 "	.popsection"
@@ -1,17 +1,18 @@
 #define PAGE_SIZE	8192
 #define TRAMP_SIZE	16
 #define TRAMP_RESERVE	0
+#define TRAMP_SLAB_PAGES	2
 
-#define TRAMP_ASM_STRING					\
-"	.pushsection .text.tramp_page,\"ax\",@progbits\n"	\
+#define TRAMP_ASM_STRING_N(NAME, DIST)				\
+"	.pushsection .text." NAME ",\"ax\",@progbits\n"		\
 "	.balign	8192\n"						\
-"tramp_page:\n"							\
+NAME ":\n"							\
 ".rept	512\n"							\
-"	ldq	$1,8192+8($27)\n"				\
-"	ldq	$27,8192($27)\n"				\
+"	ldq	$1," DIST "+8($27)\n"				\
+"	ldq	$27," DIST "($27)\n"				\
 "	jmp	$31,($27),0\n"					\
 "	nop\n"							\
 ".endr\n"							\
-"	.size tramp_page, 8192\n"				\
-"	.type tramp_page, @function\n"				\
+"	.size " NAME ", 8192\n"					\
+"	.type " NAME ", @function\n"				\
 "	.popsection"
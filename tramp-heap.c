@@ -1,175 +1,789 @@
 #define _GNU_SOURCE
-#include <limits.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "tramp.h"
 
-#define BITS_PER_INT	(CHAR_BIT * sizeof(int))
-#define MASK_SIZE	((TRAMP_COUNT + BITS_PER_INT - 1) / BITS_PER_INT)
+#define BITS_PER_WORD	64
+#define MASK_SIZE	((TRAMP_COUNT + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+/* MASK_SIZE depends on the page size, and so is not known until
+   run time.  The data page is large enough for the largest.  It
+   must not exceed the bits in the summary word.  */
+#if PAGE_SIZE / TRAMP_SIZE > BITS_PER_WORD * BITS_PER_WORD
+# error "inuse_summary too small"
+#endif
 
 struct tramp_heap_page;
 
 struct tramp_heap_data
 {
   struct tramp_heap_page *prev, *next;
+
+  /* Trampolines freed by threads other than the owner, linked through
+     their first data word.  REMOTE_UNOWNED if no thread owns the page.  */
+  uintptr_t remote_free;
+
+  /* In lock-free mode, nonzero while the page is on notfull_stack.  */
+  unsigned int listed;
+
+  /* The NUMA node whose lists the page goes on.  */
+  unsigned int node;
+
   unsigned int inuse;
-  unsigned int inuse_mask[MASK_SIZE];
+
+  /* The slot most recently freed, which is the first to be reused
+     while its cache line is still warm.  */
+  unsigned int free_hint;
+
+  /* One bit per word of inuse_mask, set while that word is not full.
+     Not maintained in lock-free mode.  */
+  uint64_t inuse_summary;
+  uint64_t inuse_mask[];
 };
 
+#define REMOTE_UNOWNED	((uintptr_t) 1)
+
+/* The code page of a pair.  The data page is __tramp_data_offset away,
+   which is not necessarily adjacent when pairs are carved from a slab.  */
 struct tramp_heap_page
 {
   char code[PAGE_SIZE];
-  struct tramp_heap_data data __attribute__((aligned(PAGE_SIZE)));
 };
 
+static inline struct tramp_heap_data *
+page_data (struct tramp_heap_page *page)
+{
+  return (struct tramp_heap_data *) (page->code + __tramp_data_offset);
+}
+
 #define TRAMP_HEAP_RESERVE \
-  ((sizeof (struct tramp_heap_data) + TRAMP_SIZE - 1) / TRAMP_SIZE)
+  ((sizeof (struct tramp_heap_data) + MASK_SIZE * sizeof (uint64_t) \
+    + TRAMP_SIZE - 1) / TRAMP_SIZE)
 
 #define TRAMP_HEAP_COUNT \
   (TRAMP_COUNT - TRAMP_HEAP_RESERVE)
 
+/* Each thread allocates from a page of its own, and frees back into it,
+   without locking.  A thread freeing into a page owned by another pushes
+   the trampoline onto the page's remote_free list, which the owner
+   drains once the page looks full.
+
+   Pages owned by no thread are either full, on notfull_page_list, or
+   if empty on empty_page_list.  These are managed under LOCK, which is
+   thus only taken to refill a thread's page, to give one up at thread
+   exit, or to free into a page that nobody owns.
+
+   Both lists are kept for each NUMA node, and a thread refills only
+   from its own node's, so that the data it loads on every call through
+   a trampoline is local.  Pages of other nodes are left to their
+   threads, or to be released.
+
+   A thread gives up ownership by swapping REMOTE_UNOWNED into an empty
+   remote_free list, which serializes against remote frees.  Ownership
+   is taken, under LOCK, by clearing the word again.  */
+
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+static struct tramp_heap_page *notfull_page_list[TRAMP_MAX_NODES];
+
+/* Empty pages are kept, so that usage oscillating at a page boundary
+   doesn't map and unmap a pair each time.  Once there are more than
+   the heap_keep_empty tunable, half of those are released together,
+   so that the boundary case doesn't simply move to the high-water
+   mark.  */
+static struct tramp_heap_page *empty_page_list[TRAMP_MAX_NODES];
+static unsigned long empty_pages;
+
+static __thread struct tramp_heap_page *thread_page;
+
+/* Used only for its destructor, which gives up the thread's page.  */
+static pthread_key_t thread_page_key;
+static pthread_once_t thread_page_once = PTHREAD_ONCE_INIT;
+
+
+/* Take LOCK, counting for __tramp_get_stats how long we waited.  Time
+   is only read when the lock is contended.  */
+
+static void
+lock_heap (void)
+{
+  struct tramp_stats *st = __tramp_stats ();
+  struct timespec t0, t1;
+
+  st->lock_acquires++;
+  if (pthread_mutex_trylock (&lock) == 0)
+    return;
+
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  pthread_mutex_lock (&lock);
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+
+  st->lock_waits++;
+  st->lock_wait_ns += ((t1.tv_sec - t0.tv_sec) * 1000000000
+		       + (t1.tv_nsec - t0.tv_nsec));
+}
+
+static void
+push_page (struct tramp_heap_page **list, struct tramp_heap_page *page,
+	   struct tramp_heap_data *data)
+{
+  struct tramp_heap_page *next = *list;
+  data->prev = NULL;
+  data->next = next;
+  if (next)
+    page_data (next)->prev = page;
+  *list = page;
+}
+
+static void
+unlink_page (struct tramp_heap_page **list, struct tramp_heap_data *data)
+{
+  struct tramp_heap_page *next, *prev;
+
+  next = data->next;
+  prev = data->prev;
+  if (next)
+    page_data (next)->prev = prev;
+  if (prev)
+    page_data (prev)->next = next;
+  else
+    *list = next;
+  data->next = data->prev = NULL;
+}
+
+/* With LOCK held, take all but KEEP pages off the empty lists, evenly
+   from each node.  Return them chained through their next fields, for
+   release_pages.  */
+
+static struct tramp_heap_page *
+shed_empty (unsigned long keep)
+{
+  struct tramp_heap_page *page, *dead = NULL;
+  struct tramp_heap_data *data;
+  unsigned int node = 0;
+
+  for (; empty_pages > keep; node = (node + 1) % TRAMP_MAX_NODES)
+    {
+      page = empty_page_list[node];
+      if (page == NULL)
+	continue;
+      data = page_data (page);
+      unlink_page (&empty_page_list[node], data);
+      data->next = dead;
+      dead = page;
+      empty_pages--;
+    }
+  return dead;
+}
+
+/* Release the pages from shed_empty, without LOCK.  */
+
+static void
+release_pages (struct tramp_heap_page *dead)
+{
+  while (dead)
+    {
+      struct tramp_heap_page *next = page_data (dead)->next;
+      __tramp_purge_pair (dead);
+      TRAMP_STAT_ADD (heap_pages, -1);
+      dead = next;
+    }
+}
+
+/* File the unowned PAGE, just emptied, with LOCK held.  Return any
+   pages to release in consequence.  */
+
+static struct tramp_heap_page *
+file_empty (struct tramp_heap_page *page, struct tramp_heap_data *data)
+{
+  unsigned long keep = __tramp_tunables.heap_keep_empty;
+
+  push_page (&empty_page_list[data->node], page, data);
+  if (++empty_pages > keep)
+    return shed_empty (keep / 2);
+  return NULL;
+}
+
+/* Claim the free slot nearest the one last freed, in the owned or
+   locked page DATA, and return its index.  The caller has checked
+   that there is one.  */
+
+static inline unsigned int
+claim_slot (struct tramp_heap_data *data)
+{
+  unsigned int index = data->free_hint;
+  unsigned int w = index / BITS_PER_WORD;
+  uint64_t old = data->inuse_mask[w];
+  uint64_t bit = 1ull << (index % BITS_PER_WORD);
+
+  if (old & bit)
+    {
+      if (old == ~0ull)
+	{
+	  w = __builtin_ctzll (data->inuse_summary);
+	  old = data->inuse_mask[w];
+	}
+      bit = ~old & -~old;
+    }
+
+  old |= bit;
+  data->inuse_mask[w] = old;
+  if (old == ~0ull)
+    data->inuse_summary &= ~(1ull << w);
+  data->inuse++;
+  return w * BITS_PER_WORD + __builtin_ctzll (bit);
+}
+
+/* Clear the inuse bit for INDEX and return the new use count.  */
+
+static inline unsigned int
+clear_slot (struct tramp_heap_data *data, unsigned int index)
+{
+  unsigned int w = index / BITS_PER_WORD;
+
+  data->inuse_mask[w] &= ~(1ull << (index % BITS_PER_WORD));
+  data->inuse_summary |= 1ull << w;
+  data->free_hint = index;
+  return --data->inuse;
+}
+
+static inline unsigned int
+tramp_index (struct tramp_heap_page *page, void *tramp)
+{
+  return ((char *) tramp - page->code) / TRAMP_SIZE - TRAMP_HEAP_RESERVE;
+}
+
+/* Set up a fresh page for NODE.  Mark the bits past the last trampoline
+   as permanently in use, so that no scan of inuse_mask ever finds them.  */
+
+static void
+init_page (struct tramp_heap_data *data, unsigned int node)
+{
+  unsigned int n = TRAMP_HEAP_COUNT;
+  unsigned int words = (n + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+  if (n % BITS_PER_WORD)
+    data->inuse_mask[n / BITS_PER_WORD] = -1ull << (n % BITS_PER_WORD);
+  for (n = words; n < MASK_SIZE; ++n)
+    data->inuse_mask[n] = -1ull;
+  data->inuse_summary = (words < BITS_PER_WORD ? (1ull << words) - 1 : -1ull);
+  data->node = node;
+}
+
+/* Return to the owned PAGE the trampolines that other threads freed.
+   Return true if there were any.  */
+
+static bool
+drain_remote (struct tramp_heap_page *page, struct tramp_heap_data *data)
+{
+  uintptr_t link;
+
+  link = __atomic_exchange_n (&data->remote_free, 0, __ATOMIC_ACQUIRE);
+  if (link == 0)
+    return false;
+
+  do
+    {
+      void *tramp = (char *) link - __tramp_data_offset;
+      clear_slot (data, tramp_index (page, tramp));
+      link = *(uintptr_t *) link;
+    }
+  while (link != 0);
+
+  return true;
+}
+
+/* Free the COUNT trampolines at TRAMPS in PAGE, owned by no thread,
+   with LOCK held.  Return any pages that should now be released to
+   the system.  */
+
+static struct tramp_heap_page *
+free_unowned (struct tramp_heap_page *page, struct tramp_heap_data *data,
+	      void *const *tramps, size_t count)
+{
+  unsigned int inuse = data->inuse;
+  size_t i;
+
+  for (i = 0; i < count; ++i)
+    clear_slot (data, tramp_index (page, tramps[i]));
+
+  /* If the page had been full, it isn't on any lists.  */
+  if (data->inuse == 0)
+    {
+      if (inuse != TRAMP_HEAP_COUNT)
+	unlink_page (&notfull_page_list[data->node], data);
+      return file_empty (page, data);
+    }
+  if (inuse == TRAMP_HEAP_COUNT)
+    push_page (&notfull_page_list[data->node], page, data);
+  return NULL;
+}
+
+/* Give up ownership of PAGE, with LOCK held, and file it according to
+   its use.  Return any pages that should be released to the system.  */
+
+static struct tramp_heap_page *
+disown_page (struct tramp_heap_page *page)
+{
+  struct tramp_heap_data *data = page_data (page);
+  uintptr_t empty;
+
+  do
+    {
+      drain_remote (page, data);
+      empty = 0;
+    }
+  while (!__atomic_compare_exchange_n (&data->remote_free, &empty,
+				       REMOTE_UNOWNED, false,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  if (data->inuse == 0)
+    return file_empty (page, data);
+  if (data->inuse < TRAMP_HEAP_COUNT)
+    push_page (&notfull_page_list[data->node], page, data);
+  return NULL;
+}
+
+static void
+thread_page_destructor (void *arg)
+{
+  struct tramp_heap_page *page = arg, *dead;
+
+  lock_heap ();
+  dead = disown_page (page);
+  pthread_mutex_unlock (&lock);
+
+  release_pages (dead);
+  thread_page = NULL;
+}
+
+static void
+thread_page_key_init (void)
+{
+  if (pthread_key_create (&thread_page_key, thread_page_destructor) != 0)
+    abort ();
+}
+
+/* Find the thread a new page, now that PAGE (if any) is full.  */
+
+static struct tramp_heap_page *
+refill_thread_page (struct tramp_heap_page *page)
+{
+  struct tramp_heap_data *data;
+  unsigned int node;
+
+  if (page)
+    {
+      uintptr_t empty = 0;
+
+      /* Before giving up a full page, collect what other threads freed.
+	 If nothing has been, the page goes to no list.  */
+      data = page_data (page);
+      if (drain_remote (page, data))
+	return page;
+      if (!__atomic_compare_exchange_n (&data->remote_free, &empty,
+					REMOTE_UNOWNED, false,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	{
+	  drain_remote (page, data);
+	  return page;
+	}
+    }
+  else
+    pthread_once (&thread_page_once, thread_page_key_init);
+
+  node = __tramp_node ();
+
+  lock_heap ();
+  page = notfull_page_list[node];
+  if (page != NULL)
+    unlink_page (&notfull_page_list[node], page_data (page));
+  else if ((page = empty_page_list[node]) != NULL)
+    {
+      unlink_page (&empty_page_list[node], page_data (page));
+      empty_pages--;
+    }
+  if (page != NULL)
+    __atomic_store_n (&page_data (page)->remote_free, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&lock);
+
+  /* A fresh pair is zeroed, and thus already owned.  */
+  if (page == NULL)
+    {
+      page = __tramp_alloc_pair ();
+      init_page (page_data (page), node);
+      TRAMP_STAT_ADD (heap_pages, 1);
+    }
+
+  thread_page = page;
+  pthread_setspecific (thread_page_key, page);
+  return page;
+}
+
+/* Fill in trampoline INDEX of PAGE and return its code address.  */
+
+static inline void *
+set_tramp (struct tramp_heap_page *page, unsigned int index,
+	   uintptr_t fnaddr, uintptr_t chain_value)
+{
+  void *tramp_code;
+  uintptr_t *tramp_data;
+
+  tramp_code = page->code + (index + TRAMP_HEAP_RESERVE) * TRAMP_SIZE;
+  tramp_data = tramp_code + __tramp_data_offset;
+
+  tramp_data[TRAMP_FUNCADDR_FIRST ? 0 : 1] = fnaddr;
+  tramp_data[TRAMP_FUNCADDR_FIRST ? 1 : 0] = chain_value;
+
+  return tramp_code;
+}
+
+
+/* The lock-free heap, selected by the heap_lockfree tunable.  It uses
+   no locks and no thread-local storage, so both entry points may be
+   called from a signal handler -- though not __tramp_heap_free while
+   any trampolines are interned, since that looks in the intern table.
+
+   All threads allocate from CUR_PAGE, claiming first a count in inuse
+   and then a bit in inuse_mask with compare-and-swap.  Other pages with
+   room are kept on NOTFULL_STACK, a Treiber stack whose head carries a
+   generation count in the bits below the page address to defeat ABA.
+   Pages are never unmapped, which is what makes it safe to look at a
+   page that another thread may have just popped.
+
+   A page other than CUR_PAGE that is not full must be on the stack.
+   Both a free and the retirement of CUR_PAGE update one word and then
+   check the other, so at least one of them sees the need to push.  */
+
 static struct tramp_heap_page *cur_page;
-static struct tramp_heap_page *notfull_page_list;
+static uintptr_t notfull_stack;
+
+static void
+lockfree_push (struct tramp_heap_page *page)
+{
+  uintptr_t tag_mask = __tramp_page_size - 1;
+  uintptr_t old, new;
+
+  old = __atomic_load_n (&notfull_stack, __ATOMIC_RELAXED);
+  do
+    {
+      page_data (page)->next = (void *) (old & ~tag_mask);
+      new = (uintptr_t) page | ((old + 1) & tag_mask);
+    }
+  while (!__atomic_compare_exchange_n (&notfull_stack, &old, new, true,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static struct tramp_heap_page *
+lockfree_pop (void)
+{
+  uintptr_t tag_mask = __tramp_page_size - 1;
+  struct tramp_heap_page *page, *next;
+  uintptr_t old, new;
+
+  old = __atomic_load_n (&notfull_stack, __ATOMIC_ACQUIRE);
+  do
+    {
+      page = (void *) (old & ~tag_mask);
+      if (page == NULL)
+	return NULL;
+      next = __atomic_load_n (&page_data (page)->next, __ATOMIC_RELAXED);
+      new = (uintptr_t) next | ((old + 1) & tag_mask);
+    }
+  while (!__atomic_compare_exchange_n (&notfull_stack, &old, new, true,
+				       __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+  __atomic_store_n (&page_data (page)->listed, 0, __ATOMIC_SEQ_CST);
+  return page;
+}
+
+/* Put PAGE on the stack, if it has room and isn't already there or
+   in use as CUR_PAGE.  */
+
+static void
+lockfree_relist (struct tramp_heap_page *page)
+{
+  struct tramp_heap_data *data = page_data (page);
+  unsigned int zero = 0;
+
+  if (__atomic_load_n (&data->inuse, __ATOMIC_SEQ_CST) < TRAMP_HEAP_COUNT
+      && __atomic_load_n (&cur_page, __ATOMIC_SEQ_CST) != page
+      && __atomic_compare_exchange_n (&data->listed, &zero, 1, false,
+				      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    lockfree_push (page);
+}
+
+/* Claim a trampoline in PAGE, returning its index, or -1 if full.  */
+
+static int
+lockfree_claim (struct tramp_heap_page *page)
+{
+  struct tramp_heap_data *data = page_data (page);
+  unsigned int n, iofs;
+  uint64_t old, mask;
+
+  /* Reserve a count first, so that a free bit is sure to exist.  Don't
+     overshoot even briefly, lest a free miss that the page has room.  */
+  n = __atomic_load_n (&data->inuse, __ATOMIC_RELAXED);
+  do
+    if (n >= TRAMP_HEAP_COUNT)
+      return -1;
+  while (!__atomic_compare_exchange_n (&data->inuse, &n, n + 1, true,
+				       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+  for (iofs = n / BITS_PER_WORD % MASK_SIZE; ; iofs = (iofs + 1) % MASK_SIZE)
+    {
+      old = __atomic_load_n (&data->inuse_mask[iofs], __ATOMIC_RELAXED);
+      while (old != ~0ull)
+	{
+	  mask = ~old & -~old;
+	  if (__atomic_compare_exchange_n (&data->inuse_mask[iofs], &old,
+					   old | mask, true, __ATOMIC_ACQUIRE,
+					   __ATOMIC_RELAXED))
+	    return iofs * BITS_PER_WORD + __builtin_ctzll (mask);
+	}
+    }
+}
+
+static void *
+lockfree_alloc (uintptr_t fnaddr, uintptr_t chain_value)
+{
+  struct tramp_heap_page *page, *next;
+  int index;
+
+  for (;;)
+    {
+      page = __atomic_load_n (&cur_page, __ATOMIC_ACQUIRE);
+      if (page && (index = lockfree_claim (page)) >= 0)
+	{
+	  TRAMP_STAT_ADD (heap_live, 1);
+	  return set_tramp (page, index, fnaddr, chain_value);
+	}
+
+      /* CUR_PAGE is full.  Replace it from the stack, or failing that
+	 with fresh pairs, the rest of which go on the stack.  */
+      next = lockfree_pop ();
+      if (next == NULL)
+	{
+	  unsigned int i, count;
+	  char *p = __tramp_map_pairs (&count);
+
+	  TRAMP_STAT_ADD (heap_pages, count);
+	  for (i = 0; i < count; ++i)
+	    init_page (page_data ((void *) (p + i * __tramp_page_size)), 0);
+	  for (i = 1; i < count; ++i)
+	    {
+	      next = (void *) (p + i * __tramp_page_size);
+	      page_data (next)->listed = 1;
+	      lockfree_push (next);
+	    }
+	  next = (void *) p;
+	}
+
+      if (__atomic_compare_exchange_n (&cur_page, &page, next, false,
+				       __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+	next = page;
+      if (next)
+	lockfree_relist (next);
+    }
+}
+
+static void
+lockfree_free (struct tramp_heap_page *page, unsigned int index)
+{
+  struct tramp_heap_data *data = page_data (page);
+
+  __atomic_fetch_and (&data->inuse_mask[index / BITS_PER_WORD],
+		      ~(1ull << (index % BITS_PER_WORD)), __ATOMIC_RELEASE);
+  __atomic_fetch_sub (&data->inuse, 1, __ATOMIC_SEQ_CST);
+  TRAMP_STAT_ADD (heap_live, -1);
+  lockfree_relist (page);
+}
+
 
-
 void *
 __tramp_heap_alloc (uintptr_t fnaddr, uintptr_t chain_value)
 {
   struct tramp_heap_page *page;
   unsigned int index;
 
-  pthread_mutex_lock (&lock);
+  if (__tramp_tunables.heap_lockfree)
+    return lockfree_alloc (fnaddr, chain_value);
 
   /* Find a page with unused entries.  */
-  page = cur_page;
-  if (page == NULL)
+  page = thread_page;
+  if (page == NULL || page_data (page)->inuse == TRAMP_HEAP_COUNT)
+    page = refill_thread_page (page);
+  index = claim_slot (page_data (page));
+  __tramp_stats ()->heap_live++;
+
+  return set_tramp (page, index, fnaddr, chain_value);
+}
+
+/* Fill whole words of inuse_mask at once, refilling the thread's page
+   only when it runs out.  */
+
+void
+__tramp_heap_alloc_n (size_t n, const uintptr_t *fns,
+		      const uintptr_t *chains, void **out)
+{
+  struct tramp_heap_page *page;
+  struct tramp_heap_data *data;
+  unsigned int w, index;
+  uint64_t old, take, bit;
+  size_t i = 0;
+
+  if (__tramp_tunables.heap_lockfree)
+    {
+      for (; i < n; ++i)
+	out[i] = lockfree_alloc (fns[i], chains[i]);
+      return;
+    }
+
+  __tramp_stats ()->heap_live += n;
+
+  while (i < n)
     {
-      page = notfull_page_list;
-      if (page != NULL)
+      page = thread_page;
+      if (page == NULL || page_data (page)->inuse == TRAMP_HEAP_COUNT)
+	page = refill_thread_page (page);
+      data = page_data (page);
+
+      while (i < n && data->inuse_summary != 0)
 	{
-	  notfull_page_list = page->data.next;
-	  if (page->data.next)
+	  w = __builtin_ctzll (data->inuse_summary);
+	  old = data->inuse_mask[w];
+	  for (take = 0; i < n && (old | take) != ~0ull; ++i)
 	    {
-	      page->data.next->data.prev = NULL;
-	      page->data.next = NULL;
+	      bit = ~(old | take) & -~(old | take);
+	      take |= bit;
+	      index = w * BITS_PER_WORD + __builtin_ctzll (bit);
+	      out[i] = set_tramp (page, index, fns[i], chains[i]);
 	    }
+	  data->inuse_mask[w] = old | take;
+	  data->inuse += __builtin_popcountll (take);
+	  if ((old | take) == ~0ull)
+	    data->inuse_summary &= ~(1ull << w);
 	}
-      else
-	page = __tramp_alloc_pair ();
     }
+}
 
-  /* Increment the use count on this page.  */
-  index = page->data.inuse++;
-  cur_page = (index == TRAMP_HEAP_COUNT - 1 ? NULL : page);
-
-  /* Find a free entry in the page.  Try index first.  */
-  {
-    unsigned int iofs, bofs, mask, old;
-
-    iofs = index / BITS_PER_INT;
-    bofs = index % BITS_PER_INT;
-    mask = 1u << bofs;
-    old = page->data.inuse_mask[iofs];
+/* Free the COUNT trampolines at TRAMPS, all in PAGE.  */
 
-    if (old & mask)
-      {
-	while (old != ~0u)
-	  {
-	    if (++iofs == MASK_SIZE)
-	      iofs = 0;
-	    old = page->data.inuse_mask[iofs];
-	  }
+static void
+free_run (struct tramp_heap_page *page, void *const *tramps, size_t count)
+{
+  struct tramp_heap_page *dead;
+  struct tramp_heap_data *data;
+  uintptr_t *link, old;
+  size_t i;
 
-	mask = ~old & -~old;
-	bofs = __builtin_ctz (mask);
-	index = iofs * BITS_PER_INT + bofs;
-      }
+  data = page_data (page);
 
-    page->data.inuse_mask[iofs] = old | mask;
-  }
+  if (__tramp_tunables.heap_lockfree)
+    {
+      for (i = 0; i < count; ++i)
+	lockfree_free (page, tramp_index (page, tramps[i]));
+      return;
+    }
 
-  {
-    void *tramp_code;
-    uintptr_t *tramp_data;
-    unsigned int index;
+  __tramp_stats ()->heap_live -= count;
 
-    tramp_code = page->code + (index + TRAMP_HEAP_RESERVE) * TRAMP_SIZE;
-    tramp_data = tramp_code + PAGE_SIZE;
+  /* Our own page needs no synchronization.  */
+  if (page == thread_page)
+    {
+      for (i = 0; i < count; ++i)
+	clear_slot (data, tramp_index (page, tramps[i]));
+      return;
+    }
 
-    tramp_data[TRAMP_FUNCADDR_FIRST ? 0 : 1] = fnaddr;
-    tramp_data[TRAMP_FUNCADDR_FIRST ? 1 : 0] = chain_value;
+  /* For a page owned by another thread, pass the trampolines to the
+     owner.  Their data is dead, so use that to chain them together,
+     and push the whole chain at once.  */
+  for (i = 0; i + 1 < count; ++i)
+    *(uintptr_t *) ((char *) tramps[i] + __tramp_data_offset)
+      = (uintptr_t) tramps[i + 1] + __tramp_data_offset;
+  link = (uintptr_t *) ((char *) tramps[count - 1] + __tramp_data_offset);
+ retry:
+  old = __atomic_load_n (&data->remote_free, __ATOMIC_RELAXED);
+  while (!(old & REMOTE_UNOWNED))
+    {
+      *link = old;
+      if (__atomic_compare_exchange_n (&data->remote_free, &old,
+				       (uintptr_t) tramps[0]
+				       + __tramp_data_offset, true,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	return;
+    }
 
-    pthread_mutex_unlock (&lock);
+  /* For a page owned by nobody, free under the lock.  */
+  lock_heap ();
+  if (!(__atomic_load_n (&data->remote_free, __ATOMIC_ACQUIRE)
+	& REMOTE_UNOWNED))
+    {
+      /* Some thread adopted the page in the meantime.  */
+      pthread_mutex_unlock (&lock);
+      goto retry;
+    }
+  dead = free_unowned (page, data, tramps, count);
+  pthread_mutex_unlock (&lock);
 
-    return tramp_code;
-  }
+  release_pages (dead);
 }
 
 void
 __tramp_heap_free (void *tramp)
 {
-  struct tramp_heap_page *page;
-  unsigned int index;
+  if (__atomic_load_n (&__tramp_intern_count, __ATOMIC_RELAXED) != 0
+      && __tramp_intern_put (tramp))
+    return;
+  free_run ((void *) ((uintptr_t) tramp & -__tramp_page_size), &tramp, 1);
+}
 
-  page = (void *)((uintptr_t)tramp & -PAGE_SIZE);
-  index = ((uintptr_t)tramp & (PAGE_SIZE - 1)) / TRAMP_SIZE;
-  index -= TRAMP_HEAP_RESERVE;
+/* Frees are grouped into runs of trampolines from the same page, which
+   is what a batch from __tramp_heap_alloc_n will mostly be.  While any
+   trampolines are interned, each must be checked for that instead.  */
 
-  pthread_mutex_lock (&lock);
+void
+__tramp_heap_free_n (size_t n, void *const *tramps)
+{
+  size_t i, j;
+
+  if (__atomic_load_n (&__tramp_intern_count, __ATOMIC_RELAXED) != 0)
+    {
+      for (i = 0; i < n; ++i)
+	__tramp_heap_free (tramps[i]);
+      return;
+    }
+
+  for (i = 0; i < n; i = j)
+    {
+      uintptr_t page = (uintptr_t) tramps[i] & -__tramp_page_size;
+
+      for (j = i + 1; j < n; ++j)
+	if (((uintptr_t) tramps[j] & -__tramp_page_size) != page)
+	  break;
+      free_run ((void *) page, tramps + i, j - i);
+    }
+}
 
-  /* Decrement the inuse counter on the page.  Shuffle the page around
-     to the proper list while we're at it.  */
-  {
-    unsigned int inuse = --page->data.inuse;
-
-    if (page != cur_page)
-      {
-	/* If the page had been full, it isn't on any lists.  */
-	if (inuse == TRAMP_HEAP_COUNT - 1)
-	  {
-	    struct tramp_heap_page *next = notfull_page_list;
-	    page->data.next = next;
-	    if (next)
-	      next->data.prev = page;
-	    notfull_page_list = page;
-	  }
-	/* If the page is now empty, remove it from the notfull list.
-	   Then either pop it into the cur_page slot or free it.  */
-	else if (inuse == 0)
-	  {
-	    struct tramp_heap_page *next, *prev;
-	    next = page->data.next;
-	    prev = page->data.prev;
-	    if (next)
-	      next->data.prev = prev;
-	    if (prev)
-	      prev->data.next = next;
-	    page->data.next = page->data.prev = NULL;
-
-	    if (cur_page == NULL)
-	      cur_page = page;
-	    else
-	      {
-		__tramp_free_pair (page);
-		goto egress;
-	      }
-	  }
-      }
-  }
-
-  /* Clear the inuse bit in the mask.  */
-  {
-    unsigned int iofs, bofs, mask;
-
-    iofs = index / BITS_PER_INT;
-    bofs = index % BITS_PER_INT;
-    mask = 1u << bofs;
-
-    page->data.inuse_mask[iofs] &= ~mask;
-  }
-
- egress:
+/* Release all but KEEP of the empty heap pages that nobody owns.
+   Return 1 if any memory was released, like malloc_trim.  */
+
+int
+__tramp_heap_trim (size_t keep)
+{
+  struct tramp_heap_page *dead;
+
+  /* The lock-free heap never gives pages back.  */
+  if (__tramp_tunables.heap_lockfree)
+    return 0;
+
+  lock_heap ();
+  dead = shed_empty (keep);
   pthread_mutex_unlock (&lock);
+
+  release_pages (dead);
+  return dead != NULL;
 }
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+
+#include "tramp.h"
+
+
+/* Interned heap trampolines are shared by every caller asking for the
+   same (fnaddr, chain_value), and counted.  They are found through a
+   hash table split into STRIPES independent parts, each with its own
+   lock and its own chained buckets, so that lookups of different pairs
+   seldom contend.  A stripe's buckets double once its entries outnumber
+   them.
+
+   The trampolines themselves are ordinary heap trampolines.  The data
+   page holds fnaddr and chain_value already, which is all that a free
+   needs to find the entry again.  */
+
+#define STRIPES		64
+
+struct intern_entry
+{
+  struct intern_entry *next;
+  uintptr_t fnaddr, chain_value;
+  void *tramp;
+  unsigned long refs;
+};
+
+static struct intern_stripe
+{
+  pthread_mutex_t lock;
+  struct intern_entry **buckets;
+  size_t nbuckets, count;
+} __attribute__((aligned (64))) stripes[STRIPES] = {
+  [0 ... STRIPES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+/* The number of interned trampolines, so that frees can skip the table
+   while there are none.  */
+unsigned long __tramp_intern_count;
+
+static inline uintptr_t
+intern_hash (uintptr_t fnaddr, uintptr_t chain_value)
+{
+  uint64_t h = (uint64_t) fnaddr * 0x9e3779b97f4a7c15ull;
+
+  h = (h ^ chain_value) * 0xbf58476d1ce4e5b9ull;
+  return h ^ (h >> 31);
+}
+
+/* Double the buckets of S, with its lock held.  If memory is short,
+   the chains just get longer.  */
+
+static void
+grow_stripe (struct intern_stripe *s)
+{
+  size_t i, n = s->nbuckets ? s->nbuckets * 2 : 16;
+  struct intern_entry **b = calloc (n, sizeof (*b));
+
+  if (b == NULL)
+    return;
+
+  for (i = 0; i < s->nbuckets; ++i)
+    {
+      struct intern_entry *e, *next;
+      for (e = s->buckets[i]; e != NULL; e = next)
+	{
+	  size_t j = intern_hash (e->fnaddr, e->chain_value) / STRIPES % n;
+	  next = e->next;
+	  e->next = b[j];
+	  b[j] = e;
+	}
+    }
+
+  free (s->buckets);
+  s->buckets = b;
+  s->nbuckets = n;
+}
+
+void *
+__tramp_heap_intern (uintptr_t fnaddr, uintptr_t chain_value)
+{
+  uintptr_t h = intern_hash (fnaddr, chain_value);
+  struct intern_stripe *s = &stripes[h % STRIPES];
+  struct intern_entry *e, **pb;
+  struct tramp_stats *st = __tramp_stats ();
+  void *tramp;
+
+  st->intern_lookups++;
+
+  pthread_mutex_lock (&s->lock);
+  if (s->count >= s->nbuckets)
+    grow_stripe (s);
+  if (s->nbuckets == 0)
+    {
+      pthread_mutex_unlock (&s->lock);
+      return __tramp_heap_alloc (fnaddr, chain_value);
+    }
+
+  pb = &s->buckets[h / STRIPES % s->nbuckets];
+  for (e = *pb; e != NULL; e = e->next)
+    if (e->fnaddr == fnaddr && e->chain_value == chain_value)
+      {
+	e->refs++;
+	tramp = e->tramp;
+	pthread_mutex_unlock (&s->lock);
+	st->intern_hits++;
+	return tramp;
+      }
+
+  /* Without an entry, the trampoline is simply not shared.  */
+  tramp = __tramp_heap_alloc (fnaddr, chain_value);
+  e = malloc (sizeof (*e));
+  if (e != NULL)
+    {
+      e->fnaddr = fnaddr;
+      e->chain_value = chain_value;
+      e->tramp = tramp;
+      e->refs = 1;
+      e->next = *pb;
+      *pb = e;
+      s->count++;
+      __atomic_fetch_add (&__tramp_intern_count, 1, __ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock (&s->lock);
+
+  return tramp;
+}
+
+/* Drop a reference to TRAMP if it is interned.  Return true if it is
+   still in use, and false if the caller should free it.  */
+
+bool
+__tramp_intern_put (void *tramp)
+{
+  uintptr_t *data = (uintptr_t *) ((char *) tramp + __tramp_data_offset);
+  uintptr_t fnaddr = data[TRAMP_FUNCADDR_FIRST ? 0 : 1];
+  uintptr_t chain_value = data[TRAMP_FUNCADDR_FIRST ? 1 : 0];
+  uintptr_t h = intern_hash (fnaddr, chain_value);
+  struct intern_stripe *s = &stripes[h % STRIPES];
+  struct intern_entry *e, **pe;
+
+  pthread_mutex_lock (&s->lock);
+  if (s->nbuckets == 0)
+    {
+      pthread_mutex_unlock (&s->lock);
+      return false;
+    }
+
+  /* A trampoline allocated by __tramp_heap_alloc may have the same
+     contents as an interned one, but not the same address.  */
+  for (pe = &s->buckets[h / STRIPES % s->nbuckets];
+       (e = *pe) != NULL; pe = &e->next)
+    if (e->tramp == tramp)
+      {
+	if (--e->refs != 0)
+	  {
+	    pthread_mutex_unlock (&s->lock);
+	    return true;
+	  }
+	*pe = e->next;
+	s->count--;
+	__atomic_fetch_sub (&__tramp_intern_count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock (&s->lock);
+	free (e);
+	return false;
+      }
+
+  pthread_mutex_unlock (&s->lock);
+  return false;
+}
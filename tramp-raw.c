@@ -1,20 +1,76 @@
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <limits.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sched.h>
 #include <link.h>
+#include <pthread.h>
 
 #include "tramp.h"
 
 
-/* Generate the tramp_page data.  The symbol is actually static, but we can't
-   tell gcc that; declaring it external and hidden is almost as good.  */
-asm(TRAMP_ASM_STRING);
+/* Generate the tramp_page data, once for each page size the kernel might
+   be using.  The symbols are actually static, but we can't tell gcc
+   that; declaring them external and hidden is almost as good.  */
+#define TRAMP_PAGE_TEMPLATE(SIZE)					\
+  asm(TRAMP_ASM_STRING_N ("tramp_page_" #SIZE, TRAMP_STR (SIZE)));	\
+  extern const char tramp_page_##SIZE[PAGE_SIZE]			\
+    __attribute__((aligned (PAGE_SIZE), visibility("hidden")));
 
-extern const char tramp_page[PAGE_SIZE]
+TRAMP_PAGE_SIZES (TRAMP_PAGE_TEMPLATE)
+
+static const struct
+{
+  size_t size;
+  const char *page;
+} tramp_page_list[] = {
+#define TRAMP_PAGE_ENTRY(SIZE)	{ SIZE, tramp_page_##SIZE },
+  TRAMP_PAGE_SIZES (TRAMP_PAGE_ENTRY)
+};
+
+/* Likewise a page of trampolines reaching TRAMP_SLAB_PAGES * PAGE_SIZE
+   bytes ahead.  Replicating this page yields a slab template for any of
+   the page sizes.  */
+#if TRAMP_SLAB_PAGES > 1
+asm(TRAMP_ASM_STRING_N ("tramp_slab_page",
+			"(" TRAMP_STR (TRAMP_SLAB_PAGES) "*"
+			TRAMP_STR (PAGE_SIZE) ")"));
+
+extern const char tramp_slab_page[PAGE_SIZE]
+  __attribute__((aligned (PAGE_SIZE), visibility("hidden")));
+#endif
+
+/* And one reaching a huge page ahead, for the huge page arenas.  */
+#ifdef TRAMP_HUGE_SIZE
+asm(TRAMP_ASM_STRING_N ("tramp_huge_page", TRAMP_STR (TRAMP_HUGE_SIZE)));
+
+extern const char tramp_huge_page[PAGE_SIZE]
   __attribute__((aligned (PAGE_SIZE), visibility("hidden")));
+#endif
+
+/* The page size of the running kernel and the matching template.  */
+size_t __tramp_page_size;
+static const char *tramp_page;
+
+static void
+page_size_init (void)
+{
+  size_t size = getpagesize ();
+  size_t i;
 
-/* ??? This and the dl_iterate_phdr callback below would not be needed if
+  for (i = 0; i < sizeof (tramp_page_list) / sizeof (tramp_page_list[0]); ++i)
+    if (tramp_page_list[i].size == size)
+      tramp_page = tramp_page_list[i].page;
+
+  __tramp_page_size = size;
+}
+
+/* ??? The dl_iterate_phdr callback below would not be needed if
    the kernel provided some way to duplicate an existing mapping within
    the current address space.
 
@@ -32,10 +88,17 @@ extern const char tramp_page[PAGE_SIZE]
    flags for the new mapping, there's no possibility of somehow forgetting
    a check and receiving a mapping with relaxed protection flags.
 
-   In the meantime, locate the filename + offset pair at which the 
-   tramp_page is located.  We don't need a lock on these since any thread
-   that computes their value will yield the same value.  Use barriers and
-   write to the filename last so that we know when we have a reliable pair.  */
+   In the meantime, the "template source" is a file descriptor plus
+   offset at which a copy of TRAMP_PAGE can be found.  We prefer a
+   sealed memfd holding a private copy, which needs no path lookup and
+   is immune to the dso being replaced on disk.  Failing that, locate
+   the filename + offset pair at which the tramp_page is located within
+   the dso.  Either way the descriptor is opened once and kept for the
+   life of the process, so that each page pair costs exactly two mmap.  */
+
+static int tramp_fd = -1;
+static off_t tramp_fd_offset;
+static pthread_once_t tramp_fd_once = PTHREAD_ONCE_INIT;
 
 static const char *tramp_dso_filename;
 static off_t tramp_dso_offset;
@@ -74,7 +137,6 @@ phdr_callback (struct dl_phdr_info *info, size_t size,
 	      filename = "/proc/self/exe";
 
             tramp_dso_offset = phdr->p_offset + (ptr - vaddr);
-	    __sync_synchronize ();
 	    tramp_dso_filename = filename;
             return 1;
           }
@@ -84,43 +146,1101 @@ phdr_callback (struct dl_phdr_info *info, size_t size,
 }
 
 
-void *
-__tramp_alloc_pair (void)
+/* Copy COPIES instances of the template PAGE into a sealed memfd,
+   created with the additional memfd FLAGS.  If ADVICE is not
+   MADV_NORMAL, apply it to the page cache while filling it.  Return the
+   descriptor, or -1 if the kernel does not support this or will not
+   let us execute it.  */
+
+static int
+template_memfd (const char *page, unsigned int copies, unsigned int flags,
+		int advice)
 {
-  void *p;
+  size_t len = (size_t) copies * __tramp_page_size;
+  unsigned int i;
+  char *p;
   int fd;
 
-  /* Open the dso file.  */
-  /* ??? We could cache this, but run the risk of running the 
-     application out of file descriptors.  */
-  if (tramp_dso_filename == NULL)
+#ifdef MFD_EXEC
+  /* Kernels with vm.memfd_noexec want executability spelled out;
+     older kernels reject the unknown flag.  */
+  fd = memfd_create ("tramp_page",
+		     MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_EXEC | flags);
+  if (fd < 0)
+#endif
+    fd = memfd_create ("tramp_page", MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+  if (fd < 0)
+    return -1;
+
+  /* Fill via a mapping rather than write, which hugetlbfs lacks.
+     This is also where hugetlbfs tells us whether huge pages exist.  */
+  if (ftruncate (fd, len) < 0)
+    goto fail;
+  p = mmap (NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    goto fail;
+  if (advice != MADV_NORMAL)
+    madvise (p, len, advice);
+  for (i = 0; i < copies; ++i)
+    memcpy (p + (size_t) i * __tramp_page_size, page, __tramp_page_size);
+  munmap (p, len);
+
+  /* Freeze the contents, so that nobody holding the descriptor can
+     change the code underneath our mappings.  Kernels before 4.16
+     cannot seal hugetlbfs; the descriptor is ours alone regardless.  */
+  if (fcntl (fd, F_ADD_SEALS,
+	     F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0
+      && !(flags & MFD_HUGETLB))
+    goto fail;
+
+  /* Make sure an executable mapping is permitted, e.g. that the memfd
+     has not been created noexec by policy.  */
+  p = mmap (NULL, len, PROT_EXEC, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    goto fail;
+  munmap (p, len);
+
+  return fd;
+
+ fail:
+  close (fd);
+  return -1;
+}
+
+/* The number of page pairs mapped together from the template source.  */
+static unsigned int tramp_slab_pages = 1;
+
+size_t __tramp_data_offset;
+
+#ifdef TRAMP_HUGE_SIZE
+#ifndef MFD_HUGE_SHIFT
+# define MFD_HUGE_SHIFT	26
+#endif
+
+/* The huge page arena mode in effect: hugetlbfs, transparent huge pages
+   from shmem, or neither.  */
+static enum { HUGE_NONE, HUGE_TLB, HUGE_THP } tramp_huge;
+
+/* Whether the data half should still try MAP_HUGETLB.  */
+static bool tramp_huge_data;
+
+/* Return true if the kernel will back shmem mappings with transparent
+   huge pages, given MADV_HUGEPAGE.  */
+
+static bool
+shmem_thp_p (void)
+{
+  char buf[128];
+  ssize_t n;
+  int fd;
+
+  fd = open ("/sys/kernel/mm/transparent_hugepage/shmem_enabled",
+	     O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  n = read (fd, buf, sizeof (buf) - 1);
+  close (fd);
+  if (n <= 0)
+    return false;
+  buf[n] = '\0';
+
+  return (strstr (buf, "[always]") || strstr (buf, "[within_size]")
+	  || strstr (buf, "[advise]") || strstr (buf, "[force]"));
+}
+
+/* Set up a template source with the data one huge page away.  Prefer
+   hugetlbfs, which keeps one physical huge page of code shared by all
+   arenas; failing that, shmem that is eligible for transparent huge
+   pages.  Return -1 if neither is available.  */
+
+static int
+template_huge (void)
+{
+  const unsigned int copies = TRAMP_HUGE_SIZE / __tramp_page_size;
+  int fd;
+
+  fd = template_memfd (tramp_huge_page, copies,
+		       MFD_HUGETLB | (__builtin_ctz (TRAMP_HUGE_SIZE)
+				      << MFD_HUGE_SHIFT),
+		       MADV_NORMAL);
+  if (fd >= 0)
+    {
+      tramp_huge = HUGE_TLB;
+      tramp_huge_data = true;
+    }
+  else if (shmem_thp_p ())
+    {
+      fd = template_memfd (tramp_huge_page, copies, 0, MADV_HUGEPAGE);
+      if (fd >= 0)
+	tramp_huge = HUGE_THP;
+    }
+
+  if (fd >= 0)
+    tramp_slab_pages = copies;
+  return fd;
+}
+#endif /* TRAMP_HUGE_SIZE */
+
+/* The number of NUMA nodes whose pages are kept apart.  With only one,
+   there is no need to ask which node a thread is on.  */
+static unsigned int tramp_nodes = 1;
+
+#ifndef MPOL_PREFERRED
+# define MPOL_PREFERRED	1
+#endif
+
+static void
+numa_init (void)
+{
+  char buf[64], *p;
+  unsigned long n = 0;
+  ssize_t len;
+  int fd;
+
+  /* The file holds a list of ranges, such as "0-3"; we want the last
+     number in it.  */
+  fd = open ("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  len = read (fd, buf, sizeof (buf) - 1);
+  close (fd);
+  if (len <= 0)
+    return;
+  buf[len] = '\0';
+
+  for (p = buf; *p != '\0'; )
+    if (*p >= '0' && *p <= '9')
+      n = strtoul (p, &p, 10);
+    else
+      ++p;
+
+  tramp_nodes = (n + 1 < TRAMP_MAX_NODES ? n + 1 : TRAMP_MAX_NODES);
+}
+
+unsigned int
+__tramp_node (void)
+{
+  unsigned int cpu, node;
+
+  if (tramp_nodes == 1 || getcpu (&cpu, &node) != 0)
+    return 0;
+  return node % tramp_nodes;
+}
+
+/* Ask that the data pages at P, not yet touched, come from NODE.  Unless
+   bound like this, they come from whichever thread first writes them,
+   which for a slab may not be the one that ends up using them.  */
+
+static void
+bind_node (void *p, size_t len, unsigned int node)
+{
+  unsigned long mask = 1ul << node;
+
+  if (tramp_nodes > 1)
+    syscall (SYS_mbind, p, len, MPOL_PREFERRED, &mask,
+	     sizeof (mask) * CHAR_BIT, 0);
+}
+
+static void
+template_init (void)
+{
+  int fd = -1;
+
+  /* In case we're called from some other object's constructor.  */
+  if (__tramp_page_size == 0)
+    page_size_init ();
+  if (tramp_page == NULL)
+    abort ();
+
+  __tramp_tunables_init ();
+  numa_init ();
+
+#ifdef TRAMP_HUGE_SIZE
+  if (__tramp_tunables.hugepages)
+    fd = template_huge ();
+#endif
+#if TRAMP_SLAB_PAGES > 1
+  if (fd < 0)
+    {
+      unsigned int copies = TRAMP_SLAB_PAGES * PAGE_SIZE / __tramp_page_size;
+
+      fd = template_memfd (tramp_slab_page, copies, 0, MADV_NORMAL);
+      if (fd >= 0)
+	tramp_slab_pages = copies;
+    }
+#endif
+  if (fd < 0)
+    fd = template_memfd (tramp_page, 1, 0, MADV_NORMAL);
+
+  if (fd >= 0)
+    tramp_fd_offset = 0;
+  else
     {
       if (dl_iterate_phdr (phdr_callback, NULL) <= 0)
 	abort ();
+      fd = open (tramp_dso_filename, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+	abort ();
+      tramp_fd_offset = tramp_dso_offset;
     }
-  fd = open (tramp_dso_filename, O_RDONLY);
-  if (fd < 0)
+
+  __tramp_data_offset = (size_t) tramp_slab_pages * __tramp_page_size;
+  tramp_fd = fd;
+}
+
+
+/* mmap and munmap, counted for __tramp_get_stats.  */
+
+static void *
+sys_mmap (void *addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+  TRAMP_STAT_ADD (mmap_calls, 1);
+  return mmap (addr, len, prot, flags, fd, off);
+}
+
+static int
+sys_munmap (void *addr, size_t len)
+{
+  TRAMP_STAT_ADD (munmap_calls, 1);
+  return munmap (addr, len);
+}
+
+
+/* A slab is tramp_slab_pages code pages mapped from the template source,
+   followed by as many data pages, followed by one page for this header.
+   The slab is aligned to its code size, so that the header can be found
+   from any of its pages.  The data pages and the header share one
+   anonymous mapping, so each slab costs two VMAs and three mmap calls
+   no matter how many trampolines it holds.  A huge page arena is the
+   same thing with one huge page each of code and data.  */
+
+#ifdef TRAMP_HUGE_SIZE
+# define SLAB_MAX_SIZE \
+  (TRAMP_HUGE_SIZE > TRAMP_SLAB_PAGES * PAGE_SIZE \
+   ? TRAMP_HUGE_SIZE : TRAMP_SLAB_PAGES * PAGE_SIZE)
+#else
+# define SLAB_MAX_SIZE	(TRAMP_SLAB_PAGES * PAGE_SIZE)
+#endif
+#define SLAB_MAX_PAGES	(SLAB_MAX_SIZE / TRAMP_MIN_PAGE_SIZE)
+#define SLAB_MASK_WORDS	((SLAB_MAX_PAGES + 63) / 64)
+
+struct tramp_slab
+{
+  struct tramp_slab *prev, *next;
+
+  /* The NUMA node of the data pages.  */
+  unsigned int node;
+
+  /* The number of free page pairs.  */
+  unsigned int nfree;
+
+  /* One bit per page pair: set when the pair is available.  */
+  uint64_t free_mask[SLAB_MASK_WORDS];
+
+  /* Set when the pair has been used and its data page is not zero.  */
+  uint64_t dirty_mask[SLAB_MASK_WORDS];
+};
+
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Slabs with at least one free pair, by node.  */
+static struct tramp_slab *partial_slab_list[TRAMP_MAX_NODES];
+
+/* The number of slabs on the list with every pair free.  These are
+   kept to avoid oscillating between mapping and unmapping a slab at the
+   boundary, and to honor the prewarm_pairs reserve.  */
+static unsigned long empty_slabs;
+
+#define SLAB_MAP_SIZE	(2 * __tramp_data_offset + __tramp_page_size)
+
+static inline struct tramp_slab *
+slab_header (void *page)
+{
+  uintptr_t base = (uintptr_t) page & -__tramp_data_offset;
+  return (struct tramp_slab *) (base + 2 * __tramp_data_offset);
+}
+
+static inline char *
+slab_base (struct tramp_slab *slab)
+{
+  return (char *) slab - 2 * __tramp_data_offset;
+}
+
+/* Fault in the pages at P, since there is no MAP_POPULATE for a mapping
+   that already exists.  */
+
+static void
+prefault (char *p, size_t len)
+{
+  size_t i;
+
+#ifdef MADV_POPULATE_WRITE
+  if (madvise (p, len, MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+  for (i = 0; i < len; i += __tramp_page_size)
+    *(volatile char *) (p + i) = 0;
+}
+
+/* Map a new slab for NODE.  POPULATE is MAP_POPULATE to prefault it,
+   or 0.  */
+
+static struct tramp_slab *
+map_slab (int populate, unsigned int node)
+{
+  size_t size = __tramp_data_offset;
+  size_t len = SLAB_MAP_SIZE;
+  size_t slop = size - __tramp_page_size;
+  struct tramp_slab *slab;
+  unsigned int i;
+  char *p, *base;
+
+  /* Over-allocate, then trim to the alignment we want.  */
+  p = sys_mmap (NULL, len + slop, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    abort ();
+
+  base = (char *) (((uintptr_t) p + size - 1) & -size);
+  if (base != p)
+    sys_munmap (p, base - p);
+  if (base + len != p + len + slop)
+    sys_munmap (base + len, p + slop - base);
+
+  if (sys_mmap (base, size, PROT_EXEC, MAP_FIXED|MAP_SHARED|populate,
+		tramp_fd, tramp_fd_offset) == MAP_FAILED)
+    abort ();
+
+#ifdef TRAMP_HUGE_SIZE
+  if (tramp_huge == HUGE_THP)
+    madvise (base, size, MADV_HUGEPAGE);
+  if (tramp_huge != HUGE_NONE)
+    {
+      /* Use a hugetlb page for the data as well, while the pool lasts.
+	 Otherwise fall back to a THP-eligible anonymous mapping.  */
+      if (tramp_huge_data
+	  && sys_mmap (base + size, size, PROT_READ|PROT_WRITE,
+		       MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB
+		       |populate, -1, 0) == MAP_FAILED)
+	{
+	  tramp_huge_data = false;
+	  if (sys_mmap (base + size, size, PROT_READ|PROT_WRITE,
+			MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)
+	      == MAP_FAILED)
+	    abort ();
+	}
+      if (!tramp_huge_data)
+	madvise (base + size, size, MADV_HUGEPAGE);
+      bind_node (base + size, size + __tramp_page_size, node);
+      if (populate)
+	prefault (base + 2 * size, __tramp_page_size);
+    }
+  else
+#endif
+    {
+      bind_node (base + size, size + __tramp_page_size, node);
+      if (populate)
+	prefault (base + size, size + __tramp_page_size);
+    }
+
+  TRAMP_STAT_ADD (pairs_mapped, tramp_slab_pages);
+  slab = (struct tramp_slab *) (base + 2 * size);
+  slab->node = node;
+  slab->nfree = tramp_slab_pages;
+  for (i = 0; i < tramp_slab_pages; ++i)
+    slab->free_mask[i / 64] |= 1ull << (i % 64);
+  return slab;
+}
+
+static void
+push_slab (struct tramp_slab *slab)
+{
+  struct tramp_slab **list = &partial_slab_list[slab->node];
+
+  slab->prev = NULL;
+  slab->next = *list;
+  if (slab->next)
+    slab->next->prev = slab;
+  *list = slab;
+}
+
+static void
+unlink_slab (struct tramp_slab *slab)
+{
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    partial_slab_list[slab->node] = slab->next;
+  slab->next = slab->prev = NULL;
+}
+
+static void *
+alloc_slab_pair (unsigned int node)
+{
+  struct tramp_slab *slab;
+  unsigned int w, index;
+  uint64_t bit;
+  bool dirty;
+  char *page;
+
+  pthread_mutex_lock (&slab_lock);
+
+  slab = partial_slab_list[node];
+  if (slab == NULL)
+    {
+      /* Don't hold the lock across the system calls.  */
+      pthread_mutex_unlock (&slab_lock);
+      slab = map_slab (0, node);
+      pthread_mutex_lock (&slab_lock);
+      push_slab (slab);
+    }
+  else if (slab->nfree == tramp_slab_pages)
+    empty_slabs--;
+
+  for (w = 0; slab->free_mask[w] == 0; ++w)
+    continue;
+  index = __builtin_ctzll (slab->free_mask[w]);
+  bit = 1ull << index;
+  index += w * 64;
+
+  slab->free_mask[w] &= ~bit;
+  dirty = (slab->dirty_mask[w] & bit) != 0;
+  slab->dirty_mask[w] &= ~bit;
+  if (--slab->nfree == 0)
+    unlink_slab (slab);
+
+  pthread_mutex_unlock (&slab_lock);
+
+  /* Hand out the data page zeroed, just as a fresh mapping would be.  */
+  page = slab_base (slab) + (size_t) index * __tramp_page_size;
+  if (dirty)
+    memset (page + __tramp_data_offset, 0, __tramp_page_size);
+  return page;
+}
+
+/* Return PAGE to its slab, with SLAB_LOCK held.  CLEAN if its data page
+   is known to be zero.  If that leaves the slab empty and not wanted,
+   take it off the list and return it for the caller to unmap once the
+   lock is dropped.  */
+
+static struct tramp_slab *
+free_slab_pair_locked (void *page, bool clean)
+{
+  struct tramp_slab *slab = slab_header (page);
+  unsigned int index;
+  unsigned long keep;
+  uint64_t bit;
+
+  index = ((char *) page - slab_base (slab)) / __tramp_page_size;
+  bit = 1ull << (index % 64);
+
+  if (slab->nfree++ == 0)
+    push_slab (slab);
+  slab->free_mask[index / 64] |= bit;
+  if (!clean)
+    slab->dirty_mask[index / 64] |= bit;
+
+  if (slab->nfree < tramp_slab_pages)
+    return NULL;
+
+  keep = __tramp_tunables.prewarm_pairs;
+  if (keep < tramp_slab_pages)
+    keep = tramp_slab_pages;
+  if ((empty_slabs + 1) * tramp_slab_pages <= keep)
+    {
+      empty_slabs++;
+      return NULL;
+    }
+
+  unlink_slab (slab);
+  return slab;
+}
+
+static void
+unmap_slab (struct tramp_slab *slab)
+{
+  if (sys_munmap (slab_base (slab), SLAB_MAP_SIZE) < 0)
     abort ();
+  TRAMP_STAT_ADD (pairs_mapped, -(unsigned long) tramp_slab_pages);
+}
+
+static void
+free_slab_pair (void *page, bool clean)
+{
+  struct tramp_slab *slab;
+
+  pthread_mutex_lock (&slab_lock);
+  slab = free_slab_pair_locked (page, clean);
+  pthread_mutex_unlock (&slab_lock);
+
+  if (slab)
+    unmap_slab (slab);
+}
+
+
+/* Without slabs, page pairs set aside by the prewarm_pairs tunable, or
+   by frees while the reserve is short, are kept on this list.  They are
+   linked through their first data word.  */
+
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *ready_pairs;
+static unsigned long ready_npairs;
+
+static void *
+map_pair (int populate)
+{
+  char *p;
 
   /* Allocate two pages.  */
-  p = mmap (NULL, 2*PAGE_SIZE, PROT_READ|PROT_WRITE,
-	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  p = sys_mmap (NULL, 2*__tramp_page_size, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
   if (p == MAP_FAILED)
     abort ();
 
   /* Overwrite the first one with a copy of TRAMP_PAGE.  */
-  p = mmap (p, PAGE_SIZE, PROT_EXEC, MAP_FIXED|MAP_SHARED,
-	    fd, tramp_dso_offset);
+  p = sys_mmap (p, __tramp_page_size, PROT_EXEC, MAP_FIXED|MAP_SHARED|populate,
+		tramp_fd, tramp_fd_offset);
   if (p == MAP_FAILED)
     abort ();
 
-  close (fd);
+  if (populate)
+    prefault (p + __tramp_page_size, __tramp_page_size);
+  TRAMP_STAT_ADD (pairs_mapped, 1);
+  return p;
+}
+
+static void
+push_ready (void **list, unsigned long *count, void *page, void **link)
+{
+  *link = *list;
+  *list = page;
+  ++*count;
+}
+
+/* Allocate a pair for NODE, making whatever system calls that takes.  */
+
+static void *
+alloc_pair_sync (unsigned int node)
+{
+  void **link;
+  char *p;
+
+  if (tramp_slab_pages > 1)
+    return alloc_slab_pair (node);
+
+  pthread_mutex_lock (&ready_lock);
+  p = ready_pairs;
+  if (p)
+    {
+      link = (void **) (p + __tramp_data_offset);
+      ready_pairs = *link;
+      ready_npairs--;
+    }
+  pthread_mutex_unlock (&ready_lock);
+
+  if (p == NULL)
+    return map_pair (0);
+
+  /* Hand out the data page zeroed, just as a fresh mapping would be.  */
+  memset (p + __tramp_data_offset, 0, __tramp_page_size);
   return p;
 }
 
+static void
+free_pair_sync (void *page)
+{
+  if (tramp_slab_pages > 1)
+    {
+      free_slab_pair (page, false);
+      return;
+    }
+
+  pthread_mutex_lock (&ready_lock);
+  if (ready_npairs < __tramp_tunables.prewarm_pairs)
+    {
+      push_ready (&ready_pairs, &ready_npairs, page,
+		  (void **) ((char *) page + __tramp_data_offset));
+      page = NULL;
+    }
+  pthread_mutex_unlock (&ready_lock);
+
+  if (page)
+    {
+      if (sys_munmap (page, 2*__tramp_page_size) < 0)
+	abort ();
+      TRAMP_STAT_ADD (pairs_mapped, -1);
+    }
+}
+
+/* Free N pairs starting with PAGE, each linked to the next through the
+   pointer LINK bytes into it, taking the lock only once.  */
+
+static void
+free_pairs_sync (char *page, size_t link, size_t n)
+{
+  struct tramp_slab *slab, *dead = NULL;
+  char *next;
+
+  if (tramp_slab_pages > 1)
+    {
+      pthread_mutex_lock (&slab_lock);
+      for (; n > 0; --n, page = next)
+	{
+	  next = *(char **) (page + link);
+	  slab = free_slab_pair_locked (page, false);
+	  if (slab)
+	    {
+	      slab->next = dead;
+	      dead = slab;
+	    }
+	}
+      pthread_mutex_unlock (&slab_lock);
+
+      for (; dead != NULL; dead = slab)
+	{
+	  slab = dead->next;
+	  unmap_slab (dead);
+	}
+      return;
+    }
+
+  pthread_mutex_lock (&ready_lock);
+  for (; n > 0 && ready_npairs < __tramp_tunables.prewarm_pairs;
+       --n, page = next)
+    {
+      next = *(char **) (page + link);
+      push_ready (&ready_pairs, &ready_npairs, page,
+		  (void **) (page + __tramp_data_offset));
+    }
+  pthread_mutex_unlock (&ready_lock);
+
+  for (; n > 0; --n, page = next)
+    {
+      next = *(char **) (page + link);
+      if (sys_munmap (page, 2*__tramp_page_size) < 0)
+	abort ();
+      TRAMP_STAT_ADD (pairs_mapped, -1);
+    }
+}
+
+/* A slab pair stays mapped until the whole slab is free, so drop the
+   data page now.  Do so before the pair goes back on the free list,
+   since from then on another thread may take it.  A huge data page
+   can't be dropped in part.  */
+
+static void
+purge_pair_sync (void *page)
+{
+  if (tramp_slab_pages > 1)
+    {
+      bool clean = false;
+
+#ifdef TRAMP_HUGE_SIZE
+      if (tramp_huge == HUGE_NONE)
+#endif
+	clean = madvise ((char *) page + __tramp_data_offset,
+			 __tramp_page_size, MADV_DONTNEED) == 0;
+      free_slab_pair (page, clean);
+      return;
+    }
+
+  free_pair_sync (page);
+}
+
+
+/* With the refill_pairs tunable, a service thread keeps that many page
+   pairs ready for each node, and frees the pairs that others release.
+   Those threads then only pop and push lock-free queues, falling back
+   to doing the work themselves when a queue is empty or full.
+
+   The queues are bounded rings of cells, each with a sequence number
+   telling whether it is ready to be written or read in the current lap,
+   so that no one ever has to look inside a page another thread may have
+   freed.  Released pairs carry PURGE_BIT if __tramp_purge_pair was
+   asked for.
+
+   ??? The thread does not survive fork.  In the child the rings are
+   used up and then bypassed, which is correct but slower.  */
+
+#define RING_SIZE	128
+#define PURGE_BIT	((uintptr_t) 1)
+
+struct svc_ring
+{
+  unsigned long head __attribute__((aligned (64)));
+  unsigned long tail __attribute__((aligned (64)));
+  struct { unsigned long seq; void *item; } cell[RING_SIZE];
+};
+
+static struct svc_ring svc_ready[TRAMP_MAX_NODES], svc_release;
+
+/* Bumped by threads wanting service; the thread sleeps on it.  */
+static unsigned int svc_wake;
+static bool svc_sleeping, svc_running;
+static unsigned long svc_low;
+static pthread_once_t svc_once = PTHREAD_ONCE_INIT;
+
+static bool
+ring_push (struct svc_ring *r, void *item)
+{
+  unsigned long pos = __atomic_load_n (&r->tail, __ATOMIC_RELAXED);
+  unsigned long seq;
+
+  for (;;)
+    {
+      seq = __atomic_load_n (&r->cell[pos % RING_SIZE].seq, __ATOMIC_ACQUIRE);
+      if (seq == pos)
+	{
+	  if (__atomic_compare_exchange_n (&r->tail, &pos, pos + 1, true,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    break;
+	}
+      else if ((long) (seq - pos) < 0)
+	return false;
+      else
+	pos = __atomic_load_n (&r->tail, __ATOMIC_RELAXED);
+    }
+
+  r->cell[pos % RING_SIZE].item = item;
+  __atomic_store_n (&r->cell[pos % RING_SIZE].seq, pos + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+static void *
+ring_pop (struct svc_ring *r)
+{
+  unsigned long pos = __atomic_load_n (&r->head, __ATOMIC_RELAXED);
+  unsigned long seq;
+  void *item;
+
+  for (;;)
+    {
+      seq = __atomic_load_n (&r->cell[pos % RING_SIZE].seq, __ATOMIC_ACQUIRE);
+      if (seq == pos + 1)
+	{
+	  if (__atomic_compare_exchange_n (&r->head, &pos, pos + 1, true,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    break;
+	}
+      else if ((long) (seq - (pos + 1)) < 0)
+	return NULL;
+      else
+	pos = __atomic_load_n (&r->head, __ATOMIC_RELAXED);
+    }
+
+  item = r->cell[pos % RING_SIZE].item;
+  __atomic_store_n (&r->cell[pos % RING_SIZE].seq, pos + RING_SIZE,
+		    __ATOMIC_RELEASE);
+  return item;
+}
+
+static inline unsigned long
+ring_count (struct svc_ring *r)
+{
+  return (__atomic_load_n (&r->tail, __ATOMIC_SEQ_CST)
+	  - __atomic_load_n (&r->head, __ATOMIC_SEQ_CST));
+}
+
+/* Ask the service thread to run.  The system call is made only if it
+   is asleep.  */
+
+static void
+svc_poke (void)
+{
+  __atomic_fetch_add (&svc_wake, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&svc_sleeping, __ATOMIC_SEQ_CST)
+      && __atomic_exchange_n (&svc_sleeping, false, __ATOMIC_SEQ_CST))
+    syscall (SYS_futex, &svc_wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Whether the service thread has work to do.  It is woken only once
+   the ready pairs are down to half, and released pairs have collected,
+   so that it works in batches.  If a few released pairs are left as it
+   goes to sleep, a timeout keeps it from leaving them for long.
+   Otherwise it sleeps until woken, so that it costs nothing while the
+   process makes no use of it, and pairs released meanwhile wait for
+   the next batch.  */
+
+static bool
+svc_work_p (void)
+{
+  unsigned int node;
+
+  if (ring_count (&svc_release) >= RING_SIZE / 2)
+    return true;
+  for (node = 0; node < tramp_nodes; ++node)
+    if (ring_count (&svc_ready[node]) < (svc_low + 1) / 2)
+      return true;
+  return false;
+}
+
+static void *
+svc_thread (void *arg)
+{
+  struct timespec idle = { 0, 50 * 1000 * 1000 };
+  unsigned int node, wake;
+  uintptr_t item;
+  char *p;
+
+  for (;;)
+    {
+      wake = __atomic_load_n (&svc_wake, __ATOMIC_SEQ_CST);
+
+      while ((item = (uintptr_t) ring_pop (&svc_release)) != 0)
+	{
+	  if (item & PURGE_BIT)
+	    purge_pair_sync ((void *) (item & ~PURGE_BIT));
+	  else
+	    free_pair_sync ((void *) item);
+	}
+
+      /* Hand out pairs with the data page already faulted in.  The code
+	 page may be execute-only, so can't be touched.  */
+      for (node = 0; node < tramp_nodes; ++node)
+	while (ring_count (&svc_ready[node]) < svc_low)
+	  {
+	    p = alloc_pair_sync (node);
+	    prefault (p + __tramp_data_offset, __tramp_page_size);
+	    if (!ring_push (&svc_ready[node], p))
+	      {
+		free_pair_sync (p);
+		break;
+	      }
+	  }
+
+      __atomic_store_n (&svc_sleeping, true, __ATOMIC_SEQ_CST);
+      if (!svc_work_p ())
+	syscall (SYS_futex, &svc_wake, FUTEX_WAIT_PRIVATE, wake,
+		 ring_count (&svc_release) ? &idle : NULL, NULL, 0);
+      __atomic_store_n (&svc_sleeping, false, __ATOMIC_SEQ_CST);
+    }
+
+  return arg;
+}
+
+/* The locks above are not recursive, so a signal handler that wants a
+   page pair must not be let in while one is held.  */
+
+static inline void
+block_signals (sigset_t *old_set)
+{
+  sigset_t full_set;
+
+  sigfillset (&full_set);
+  pthread_sigmask (SIG_SETMASK, &full_set, old_set);
+}
+
+static inline void
+unblock_signals (sigset_t *old_set)
+{
+  pthread_sigmask (SIG_SETMASK, old_set, NULL);
+}
+
+static void
+svc_start (void)
+{
+  pthread_attr_t attr;
+  sigset_t all, old;
+  pthread_t th;
+  unsigned int i, j;
+
+  svc_low = __tramp_tunables.refill_pairs;
+  if (svc_low > RING_SIZE)
+    svc_low = RING_SIZE;
+
+  for (i = 0; i < TRAMP_MAX_NODES; ++i)
+    for (j = 0; j < RING_SIZE; ++j)
+      svc_ready[i].cell[j].seq = j;
+  for (j = 0; j < RING_SIZE; ++j)
+    svc_release.cell[j].seq = j;
+
+  /* The thread inherits the mask, and should take no signals.  */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create (&th, &attr, svc_thread, NULL) == 0)
+    __atomic_store_n (&svc_running, true, __ATOMIC_RELEASE);
+  pthread_attr_destroy (&attr);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+}
+
+void *
+__tramp_alloc_pair (void)
+{
+  unsigned int node;
+  sigset_t old_set;
+  void *p;
+
+  pthread_once (&tramp_fd_once, template_init);
+
+  node = __tramp_node ();
+  if (__tramp_tunables.refill_pairs)
+    {
+      pthread_once (&svc_once, svc_start);
+      if (__atomic_load_n (&svc_running, __ATOMIC_ACQUIRE))
+	{
+	  p = ring_pop (&svc_ready[node]);
+	  if (ring_count (&svc_ready[node]) < (svc_low + 1) / 2)
+	    svc_poke ();
+	  if (p)
+	    return p;
+	}
+    }
+
+  block_signals (&old_set);
+  p = alloc_pair_sync (node);
+  unblock_signals (&old_set);
+  return p;
+}
+
+static void
+release_pair (void *page, uintptr_t purge)
+{
+  sigset_t old_set;
+
+  if (__atomic_load_n (&svc_running, __ATOMIC_ACQUIRE)
+      && ring_push (&svc_release, (void *) ((uintptr_t) page | purge)))
+    {
+      if (ring_count (&svc_release) >= RING_SIZE / 2)
+	svc_poke ();
+      return;
+    }
+
+  block_signals (&old_set);
+  if (purge)
+    purge_pair_sync (page);
+  else
+    free_pair_sync (page);
+  unblock_signals (&old_set);
+}
+
 void
 __tramp_free_pair (void *page)
 {
-  if (munmap (page, 2*PAGE_SIZE) < 0)
+  release_pair (page, 0);
+}
+
+void
+__tramp_purge_pair (void *page)
+{
+  release_pair (page, PURGE_BIT);
+}
+
+void
+__tramp_free_pairs (void *page, size_t link, size_t n)
+{
+  sigset_t old_set;
+  void *next;
+
+  if (__atomic_load_n (&svc_running, __ATOMIC_ACQUIRE))
+    {
+      for (; n > 0; --n, page = next)
+	{
+	  next = *(void **) ((char *) page + link);
+	  if (!ring_push (&svc_release, page))
+	    break;
+	}
+      if (ring_count (&svc_release) >= RING_SIZE / 2)
+	svc_poke ();
+    }
+  if (n == 0)
+    return;
+
+  block_signals (&old_set);
+  free_pairs_sync (page, link, n);
+  unblock_signals (&old_set);
+}
+
+void *
+__tramp_map_pairs (unsigned int *count)
+{
+  pthread_once (&tramp_fd_once, template_init);
+
+  /* No one will look at the header of this slab.  */
+  *count = tramp_slab_pages;
+  if (tramp_slab_pages > 1)
+    return slab_base (map_slab (0, __tramp_node ()));
+  return map_pair (0);
+}
+
+void *
+__tramp_reserve_log (size_t size)
+{
+  void *p;
+
+  pthread_once (&tramp_fd_once, template_init);
+
+  p = sys_mmap (NULL, size, PROT_NONE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+void
+__tramp_commit_log (void *p, size_t len)
+{
+  if (mprotect (p, len, PROT_READ|PROT_WRITE) < 0)
+    abort ();
+  TRAMP_STAT_ADD (log_pages_mapped, len / __tramp_page_size);
+}
+
+void
+__tramp_release_log (void *p, size_t size, size_t committed)
+{
+  if (sys_munmap (p, size) < 0)
     abort ();
+  TRAMP_STAT_ADD (log_pages_mapped,
+		  -(unsigned long) (committed / __tramp_page_size));
+}
+
+/* Map and prefault the reserve requested by the prewarm tunables.
+   Slabs are dealt out to the nodes in turn, since the threads that will
+   use them may run anywhere.  */
+
+static void
+prewarm (void)
+{
+  unsigned long n = __tramp_tunables.prewarm_pairs;
+  unsigned int node = 0;
+  char *p;
+
+  if (tramp_slab_pages > 1)
+    {
+      pthread_mutex_lock (&slab_lock);
+      for (; n > 0; n -= (n < tramp_slab_pages ? n : tramp_slab_pages))
+	{
+	  push_slab (map_slab (MAP_POPULATE, node));
+	  node = (node + 1) % tramp_nodes;
+	  empty_slabs++;
+	}
+      pthread_mutex_unlock (&slab_lock);
+    }
+  else
+    {
+      pthread_mutex_lock (&ready_lock);
+      for (; n > 0; --n)
+	{
+	  p = map_pair (MAP_POPULATE);
+	  push_ready (&ready_pairs, &ready_npairs, p,
+		      (void **) (p + __tramp_data_offset));
+	}
+      pthread_mutex_unlock (&ready_lock);
+    }
+}
+
+/* Do the one-time setup when the library is loaded, so that the first
+   trampolines need not pay for it.  */
+
+static void __attribute__((constructor))
+tramp_init (void)
+{
+  pthread_once (&tramp_fd_once, template_init);
+  prewarm ();
+
+  /* Start the service thread now too, since the first pair may well be
+     wanted by a signal handler, which can't create threads.  */
+  if (__tramp_tunables.refill_pairs)
+    pthread_once (&svc_once, svc_start);
 }
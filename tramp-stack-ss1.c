@@ -290,7 +290,7 @@ __tramp_stack_alloc (uintptr_t cfa, uintptr_t fnaddr, uintptr_t chain_value)
     index = A->cur_page_inuse++;
 
     tramp_code = page + index * TRAMP_SIZE;
-    tramp_data = tramp_code + PAGE_SIZE;
+    tramp_data = tramp_code + __tramp_data_offset;
 
     tramp_data[TRAMP_FUNCADDR_FIRST ? 0 : 1] = fnaddr;
     tramp_data[TRAMP_FUNCADDR_FIRST ? 1 : 0] = chain_value;
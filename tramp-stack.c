@@ -1,73 +1,192 @@
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <limits.h>
 #include <sys/mman.h>
+#include <string.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include "tramp.h"
 
 
 /* The "log" is a record of the actions we have performed within the
-   current thread.  These actions include allocating trampolines on
-   behalf of a given stack frame, allocating trampoline page pairs,
-   and allocating more log space.  It is organized this way in order
-   to minimize memory allocation overhead.
+   current thread, which are allocating trampolines on behalf of a
+   given stack frame.  It is organized this way in order to minimize
+   memory allocation overhead.
+
+   The log is one range of LOG_RESERVE bytes of address space, reserved
+   the first time it is needed.  Pages are made usable LOG_COMMIT at a
+   time as it grows, and never taken back, but once the log shrinks well
+   below the most it has held, the pages past its end are given back
+   with MADV_FREE, which the kernel reclaims only if it must.  Fibers
+   start instead with a slot of LOG_SLOT bytes, shared out of larger
+   mappings, and move to a range of their own only if they outgrow it.
 
    Entries in the log are pairs of uintptr_t.  The first entry of the
    pair indicates the type of action, and the second is some sort of
    data associated with that action:
 
-   0	Allocated a new log page.  The data entry is the pointer to
-	the previous log page.  This will only ever appear as the
-	first entry of a log page.
-
-   1	Allocated a new tramp page pair.  The data entry is the pointer
-	to the previous pair.
-
-   2	Entered the signal stack.  The data entry is ignored.
+   1	A checkpoint, found at every LOG_STRIDE words of the log.  The
+	data entry is the number of trampolines allocated by the
+	entries before it.
 
    CFA	Allocated trampoine entries on behalf of the function instance
-	identified by its Canonical Frame Address.  The data entry is
-	the number of trampolines allocated.  This number will never be
-	more than the number of trampolines remaining in the current
-	tramp page pair.  If the function requires more trampolines,
-	we'll use additional log entries.
+	identified by its Canonical Frame Address, or rather by a key
+	made from that which orders frames across stack segments.  The
+	data entry is the number of trampolines allocated.  Consecutive
+	entries for the same CFA are merged.
+
+   The CFAs run from oldest to newest,
+   so the point to which a frame unwinds is found by binary search,
+   and the checkpoint just before it gives the number of trampolines
+   still live there.
+
+   The page pairs themselves are chained through the data of their last
+   trampoline, which is never handed out, so that those wholly past the
+   cut are found without the log.
+
+   Frames on the signal stack are logged in a state of their own, as
+   are those of handlers that interrupt an allocation.  Each keeps a
+   reserve of page pairs and a committed log, so that handlers need make
+   no system calls to allocate.
 */
 
-#define LOG_NEW_LOG	0
-#define LOG_NEW_PAGE	1
-#define LOG_SIGSTACK	2
-#define LOG_SIZE	(PAGE_SIZE / sizeof(uintptr_t))
+#define LOG_CHECKPOINT	1
+#define LOG_STRIDE	64
 
-/* All thread-local variables.  */
-struct tramp_globals
+/* The slot of each page pair that holds the link to the previous one,
+   and the number of trampolines left for use.  */
+#define PAGE_LINK	(TRAMP_COUNT - 1)
+#define PAGE_TRAMPS	(TRAMP_COUNT - 1 - TRAMP_RESERVE)
+
+#define LOG_RESERVE	((size_t) 1 << (sizeof (uintptr_t) == 8 ? 28 : 24))
+#define LOG_COMMIT	(16 * __tramp_page_size)
+#define LOG_WORDS(N)	((N) / sizeof (uintptr_t))
+
+/* Allocations within a given context.  */
+struct tramp_alloc_state
 {
   /* The current page from which we are allocating trampolines.  */
   void *cur_page;
 
-  /* The current page from which we are logging actions.  */
+  /* The start of the log, or null if not yet reserved.  */
   uintptr_t *cur_log;
 
   /* The number of trampolines allocated from the current page.  */
   unsigned int cur_page_inuse;
 
-  /* The number of log entries in use in the current page.  */
-  unsigned int cur_log_inuse;
+  /* The number of words of the log in use, the number committed, the
+     most in use since pages were last given back, and the number
+     reserved.  */
+  size_t cur_log_inuse;
+  size_t cur_log_committed;
+  size_t cur_log_hwm;
+  size_t cur_log_reserved;
+
+  /* The number of trampolines allocated, over all page pairs.  */
+  uintptr_t total;
 
   /* The "current" cfa for subsequent allocations from this function.  */
   uintptr_t cur_cfa;
 
-  /* The active signal stack, assuming SS_ONSTACK is set.  */
+  /* A previously allocated page pair not yet released to the system.  */
+  void *save_page;
+
+  /* More page pairs kept for the signal stack, chained like those in
+     use, how many there are, and how many to keep.  */
+  void *reserve;
+  unsigned int nreserve, reserve_want;
+
+  /* True for NESTED_STATE; see STACK_STAT_ADD.  */
+  bool nested;
+};
+
+/* A context with a stack of its own: the thread, or one of its fibers
+   made with __tramp_ctx_create.  */
+struct tramp_ctx
+{
+  /* The allocations made on that stack.  */
+  struct tramp_alloc_state state;
+
+  /* The bounds of the stack, both 1 if unknown, and the bias from its
+     addresses to frame keys.  */
+  uintptr_t stack_lo, stack_hi, stack_bias;
+
+  /* True if the bounds were not given, but are widened to take in the
+     frames seen; see learn_bounds.  */
+  bool learn;
+};
+
+/* All thread-local variables.  */
+struct tramp_globals
+{
+  /* The context running now, which is THREAD_CTX or a fiber's, and so
+     the allocations it makes.  Set when the thread first allocates.  */
+  struct tramp_ctx *ctx;
+  struct tramp_ctx thread_ctx;
+
+  /* The allocations made on the signal stack, and by signal handlers
+     that interrupted __tramp_stack_alloc while it was updating CTX.  */
+  struct tramp_alloc_state signal_state;
+  struct tramp_alloc_state nested_state;
+
+  /* The state the last frame allocated in, which is that of CTX or
+     SIGNAL_STATE.  */
+  struct tramp_alloc_state *cur_state;
+
+  /* The signal stack last seen, with SS_ONSTACK set while SIGNAL_STATE
+     is in use.  */
   stack_t cur_sigstack;
 
-  /* Previously allocated pages not yet released to the system.  */
-  void *save_page;
-  uintptr_t *save_log;
+  /* True if the reserves of SIGNAL_STATE and NESTED_STATE want
+     refilling, and the frames entered since sigaltstack was last asked
+     for a signal stack.  */
+  bool refill;
+  unsigned int sigstack_poll;
+
+  /* True once settle_thread has set the thread key and asked for the
+     bounds of the thread's stack.  */
+  bool settled;
+
+  /* The bounds of the stack segment that held the last frame, both 1
+     if unknown, and the bias from its addresses to frame keys.  */
+  uintptr_t stack_lo, stack_hi, stack_bias;
+
+  /* The table of stack segments, its size and capacity.  */
+  struct tramp_stack_seg *segs;
+  unsigned int nsegs, maxsegs;
+
+  /* Nonzero while CTX is being updated or switched, and the frame of
+     the call doing that.  */
+  unsigned int busy;
+  uintptr_t busy_sp;
+
+  /* The thread's stack_live count as it was marked busy, and the totals
+     of CTX's state and SIGNAL_STATE that it covered; see mark_busy.  */
+  unsigned long busy_live;
+  uintptr_t busy_ctx_total, busy_signal_total;
+
+  /* Bumped on each entry to __tramp_stack_alloc, and the value it had
+     when NESTED_STATE was last used.  */
+  unsigned long epoch, nested_epoch;
 };
 
+/* TRAMP_COUNT is not constant, so start with an impossibly full page
+   to force the first allocation to find a real one.  */
 static __thread struct tramp_globals tramp_G = {
-  .cur_page_inuse = TRAMP_COUNT,
+  .thread_ctx.state.cur_page_inuse = UINT_MAX,
+  .signal_state.cur_page_inuse = UINT_MAX,
+  .nested_state.cur_page_inuse = UINT_MAX,
+  .nested_state.nested = true,
 };
 
+/* Count N in FIELD of the statistics for S.  Handlers allocating from
+   NESTED_STATE may have interrupted an update of the thread's own
+   counters, so their counts go atomically to __tramp_stats_retired.  */
+#define STACK_STAT_ADD(S, FIELD, N) \
+  ((S)->nested ? (void) TRAMP_STAT_ADD (FIELD, N) \
+   : (void) (__tramp_stats ()->FIELD += (N)))
+
 static inline struct tramp_globals *
 get_globals (void)
 {
@@ -82,264 +201,1589 @@ get_globals (void)
   return G;
 }
 
-/* Allocate and free one trampoline page pair, using a thread-local cache.  */
+/* Keep out signal handlers that might call __tramp_stack_alloc while
+   a lock is held here, or state they use is being changed.  The page
+   allocators do the same around their own locks.  */
 
-static inline void *
-alloc_one_tramp_page (struct tramp_globals *G)
+static inline void
+block_signals (sigset_t *old_set)
 {
-  void *ret = G->save_page;
-  if (ret == 0)
-    ret = __tramp_alloc_pair ();
-  else
-    G->save_page = 0;
-  return ret;
+  sigset_t full_set;
+
+  sigfillset (&full_set);
+  pthread_sigmask (SIG_SETMASK, &full_set, old_set);
 }
 
 static inline void
-free_one_tramp_page (struct tramp_globals *G, void *page)
+unblock_signals (sigset_t *old_set)
 {
-  void *old = G->save_page;
-  G->save_page = page;
-  if (old)
-    __tramp_free_pair (old);
+  pthread_sigmask (SIG_SETMASK, old_set, NULL);
 }
 
-/* Allocate and free one log page, using a thread-local cache.  */
+/* Page pairs and logs left by threads that have exited, for the next
+   ones to start with.  Each slot holds one or is null, and is taken or
+   filled by a single atomic operation, so there is no list for a lock
+   or an ABA tag to protect.  The counts only tell when to bother
+   looking.  */
+/* ??? The pairs keep the NUMA node of the thread that had them.  */
+
+#define POOL_PAIRS	64
+#define POOL_LOGS	16
 
-static inline uintptr_t *
-alloc_one_log_page (struct tramp_globals *G)
+static void *pool_pairs[POOL_PAIRS];
+static void *pool_logs[POOL_LOGS];
+static unsigned int pool_npairs, pool_nlogs;
+
+static bool
+pool_put (void **pool, unsigned int size, unsigned int *count, void *p)
 {
-  void *ret = G->save_log;
-  if (ret == 0)
+  unsigned int i;
+  void *empty;
+
+  for (i = 0; i < size; ++i)
     {
-      ret = mmap (NULL, PAGE_SIZE, PROT_READ|PROT_WRITE,
-		  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-      if (ret == MAP_FAILED)
-	abort ();
+      empty = NULL;
+      if (__atomic_compare_exchange_n (&pool[i], &empty, p, false,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	{
+	  __atomic_fetch_add (count, 1, __ATOMIC_RELAXED);
+	  return true;
+	}
     }
+  return false;
+}
+
+static void *
+pool_get (void **pool, unsigned int size, unsigned int *count)
+{
+  unsigned int i;
+  void *p;
+
+  if (__atomic_load_n (count, __ATOMIC_RELAXED) == 0)
+    return NULL;
+  for (i = 0; i < size; ++i)
+    if (__atomic_load_n (&pool[i], __ATOMIC_RELAXED) != NULL
+	&& (p = __atomic_exchange_n (&pool[i], NULL, __ATOMIC_ACQUIRE)))
+      {
+	__atomic_fetch_sub (count, 1, __ATOMIC_RELAXED);
+	return p;
+      }
+  return NULL;
+}
+
+/* Log slots for fibers, so that each needs no mappings of its own.
+   They are cut LOG_SLOTS at a time from mappings that are never given
+   back, and those freed are chained through their first word.  Their
+   pages are all usable from the start, and count as committed while
+   the slot is in use.  */
+
+#define LOG_SLOT	LOG_COMMIT
+#define LOG_SLOTS	64
+
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *slot_next, *slot_end;
+static void *free_slots;
+
+static uintptr_t *
+get_log_slot (void)
+{
+  sigset_t old_set;
+  void *p;
+
+  block_signals (&old_set);
+  pthread_mutex_lock (&slot_lock);
+  p = free_slots;
+  if (p)
+    free_slots = *(void **) p;
   else
-    G->save_log = 0;
+    {
+      if (slot_next == slot_end)
+	{
+	  p = mmap (NULL, LOG_SLOTS * LOG_SLOT, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	  if (p != MAP_FAILED)
+	    {
+	      slot_next = p;
+	      slot_end = slot_next + LOG_SLOTS * LOG_SLOT;
+	      TRAMP_STAT_ADD (mmap_calls, 1);
+	    }
+	  p = NULL;
+	}
+      if (slot_next != slot_end)
+	{
+	  p = slot_next;
+	  slot_next += LOG_SLOT;
+	}
+    }
+  pthread_mutex_unlock (&slot_lock);
+  unblock_signals (&old_set);
+
+  if (p)
+    TRAMP_STAT_ADD (log_pages_mapped, LOG_SLOT / __tramp_page_size);
+  return p;
+}
+
+static void
+put_log_slot (void *p)
+{
+  sigset_t old_set;
+
+  madvise (p, LOG_SLOT, MADV_DONTNEED);
+  TRAMP_STAT_ADD (log_pages_mapped,
+		  -(unsigned long) (LOG_SLOT / __tramp_page_size));
+
+  block_signals (&old_set);
+  pthread_mutex_lock (&slot_lock);
+  *(void **) p = free_slots;
+  free_slots = p;
+  pthread_mutex_unlock (&slot_lock);
+  unblock_signals (&old_set);
+}
+
+/* The link from PAGE to the page pair before it.  */
+
+static inline void **
+page_link (void *page)
+{
+  return page + PAGE_LINK * TRAMP_SIZE + __tramp_data_offset;
+}
+
+/* Allocate one trampoline page pair, using a cache in S, and then its
+   reserve.  */
+
+static inline void *
+alloc_one_tramp_page (struct tramp_alloc_state *S)
+{
+  void *ret = S->save_page;
+
+  STACK_STAT_ADD (S, save_page_lookups, 1);
+  if (ret)
+    {
+      S->save_page = 0;
+      STACK_STAT_ADD (S, save_page_hits, 1);
+      return ret;
+    }
+  if (S->reserve)
+    {
+      ret = S->reserve;
+      S->reserve = *page_link (ret);
+      S->nreserve--;
+      return ret;
+    }
+
+  ret = pool_get (pool_pairs, POOL_PAIRS, &pool_npairs);
+  if (ret == 0)
+    ret = __tramp_alloc_pair ();
   return ret;
 }
 
-static inline void
-free_one_log_page_raw (uintptr_t *log)
+/* Make room in the log of S for one more entry.  A thread's first log
+   comes from the pool if it can, with its first word telling how many
+   words of it are committed, and is a slot if no range can be
+   reserved.  A slot outgrown is copied to a range of its own.  */
+
+static void __attribute__((noinline))
+grow_log (struct tramp_alloc_state *S)
 {
-  if (munmap (log, PAGE_SIZE) < 0)
+  size_t committed;
+  uintptr_t *log, *old;
+
+  if (S->cur_log == NULL)
+    {
+      S->cur_log_reserved = LOG_WORDS (LOG_RESERVE);
+      S->cur_log = pool_get (pool_logs, POOL_LOGS, &pool_nlogs);
+      if (S->cur_log)
+	{
+	  S->cur_log_committed = S->cur_log_hwm = S->cur_log[0];
+	  return;
+	}
+      S->cur_log = __tramp_reserve_log (LOG_RESERVE);
+      if (S->cur_log == NULL)
+	{
+	  S->cur_log = get_log_slot ();
+	  if (S->cur_log == NULL)
+	    abort ();
+	  S->cur_log_committed = S->cur_log_reserved = LOG_WORDS (LOG_SLOT);
+	  return;
+	}
+    }
+  else if (S->cur_log_reserved == LOG_WORDS (LOG_SLOT)
+	   && S->cur_log_committed == S->cur_log_reserved)
+    {
+      log = __tramp_reserve_log (LOG_RESERVE);
+      if (log == NULL)
+	abort ();
+      __tramp_commit_log (log, LOG_SLOT + LOG_COMMIT);
+      memcpy (log, S->cur_log, LOG_SLOT);
+      S->cur_log_committed = LOG_WORDS (LOG_SLOT + LOG_COMMIT);
+      S->cur_log_reserved = LOG_WORDS (LOG_RESERVE);
+      old = S->cur_log;
+      S->cur_log = log;
+      put_log_slot (old);
+      return;
+    }
+
+  committed = S->cur_log_committed * sizeof (uintptr_t);
+  if (committed + LOG_COMMIT > S->cur_log_reserved * sizeof (uintptr_t))
     abort ();
+  __tramp_commit_log ((char *) S->cur_log + committed, LOG_COMMIT);
+  S->cur_log_committed += LOG_WORDS (LOG_COMMIT);
 }
 
-static inline void
-free_one_log_page (struct tramp_globals *G, uintptr_t *log)
+/* Once the log of S has shrunk by two commits from its high-water mark,
+   give back the pages beyond one commit past its end.  */
+
+static void
+shrink_log (struct tramp_alloc_state *S)
 {
-  uintptr_t *old = G->save_log;
-  G->save_log = log;
-  if (old)
-    free_one_log_page_raw (old);
+  size_t keep = S->cur_log_inuse + LOG_WORDS (2 * LOG_COMMIT);
+  size_t page = LOG_WORDS (__tramp_page_size);
+  size_t from;
+
+  if (S->cur_log_hwm <= keep)
+    return;
+
+  from = (S->cur_log_inuse + LOG_WORDS (LOG_COMMIT) + page - 1) & -page;
+#ifdef MADV_FREE
+  madvise (S->cur_log + from, (S->cur_log_hwm - from) * sizeof (uintptr_t),
+	   MADV_FREE);
+#else
+  madvise (S->cur_log + from, (S->cur_log_hwm - from) * sizeof (uintptr_t),
+	   MADV_DONTNEED);
+#endif
+  S->cur_log_hwm = from;
 }
 
-/* Return true if CFA A is older than CFA B on the stack.  */
-/* ??? Under normal conditions this can be a simple pointer comparison
-   based on whether or not the stack grows down or up.  If split stacks
-   are in use, this ought to involve some sort of data structure search
-   to which we have no access given the current API.  */
+/* Return true if the frame with key A is older than that with key B.
+   See below for how keys are ordered.  */
 static inline bool
 cfa_older_p (uintptr_t a, uintptr_t b)
 {
-  /* ??? Assume stack grows down.  */
   return a > b;
 }
 
+/* Return true if the frame of the log entry at P, or of the one after
+   it if that is a checkpoint, is older than CFA.  END bounds the
+   search.  */
+
+static inline bool
+entry_older_p (const uintptr_t *log, size_t p, size_t end, uintptr_t cfa)
+{
+  uintptr_t action = log[p];
+
+  if (action == LOG_CHECKPOINT)
+    {
+      if (p + 2 >= end)
+	return false;
+      action = log[p + 2];
+    }
+  return cfa_older_p (action, cfa);
+}
+
+/* Return the position of the first entry in [LO, END) of the log that
+   is no older than CFA, or END.  */
+
+static size_t
+find_cut (const uintptr_t *log, size_t lo, size_t end, uintptr_t cfa)
+{
+  size_t n = (end - lo) / 2, half;
+
+  while (n > 0)
+    {
+      half = n / 2;
+      if (entry_older_p (log, lo + 2 * half, end, cfa))
+	{
+	  lo += 2 * half + 2;
+	  n -= half + 1;
+	}
+      else
+	n = half;
+    }
+  return lo;
+}
+
+/* Return the number of trampolines allocated by the entries before
+   position P of the log, which is in use.  */
+
+static uintptr_t
+total_at (const uintptr_t *log, size_t p)
+{
+  size_t i = p & -(size_t) LOG_STRIDE;
+  uintptr_t total = log[i + 1];
+
+  for (i += 2; i < p; i += 2)
+    if (log[i] > LOG_CHECKPOINT)
+      total += log[i + 1];
+  return total;
+}
+
+/* Free the first N page pairs in the chain of S, with one call.  */
+
+static void
+free_pages (struct tramp_alloc_state *S, uintptr_t n)
+{
+  void *page = S->cur_page;
+  uintptr_t i;
+
+  for (i = 0; i < n; ++i)
+    S->cur_page = *page_link (S->cur_page);
+  __tramp_free_pairs (page, PAGE_LINK * TRAMP_SIZE + __tramp_data_offset, n);
+}
+
+/* Drop the log of S from position CUT, and release the trampolines it
+   recorded.  Page pairs no longer used go back to the reserve as far
+   as it wants them, and the rest are freed together.  */
+
+static void
+cut_log (struct tramp_alloc_state *S, size_t cut)
+{
+  uintptr_t total = total_at (S->cur_log, cut);
+  uintptr_t pages = (S->total + PAGE_TRAMPS - 1) / PAGE_TRAMPS;
+  uintptr_t keep = (total + PAGE_TRAMPS - 1) / PAGE_TRAMPS;
+  void *page;
+
+  for (; pages > keep; --pages)
+    {
+      if (S->save_page != NULL && S->nreserve >= S->reserve_want)
+	break;
+      page = S->cur_page;
+      S->cur_page = *page_link (page);
+      if (S->save_page == NULL)
+	S->save_page = page;
+      else
+	{
+	  *page_link (page) = S->reserve;
+	  S->reserve = page;
+	  S->nreserve++;
+	}
+    }
+  if (pages > keep)
+    free_pages (S, pages - keep);
+
+  if (keep)
+    S->cur_page_inuse = TRAMP_RESERVE + total - (keep - 1) * PAGE_TRAMPS;
+  else
+    S->cur_page_inuse = TRAMP_COUNT;
+
+  STACK_STAT_ADD (S, replay_entries, (S->cur_log_inuse - cut) / 2);
+  STACK_STAT_ADD (S, stack_live, -(unsigned long) (S->total - total));
+  S->total = total;
+  S->cur_log_inuse = cut;
+  shrink_log (S);
+}
+
 /* Replay the log until we get back to an entry older than CFA.
-   Note that -1 can be used in order to reply the entire log.  */
+   Note that -1 can be used in order to replay the whole log.  */
 /* ??? Except that -1 assumes stack grows down; 0 would be the
    stack grows up magic value.  */
 
 static void
-replay_log (struct tramp_globals *G, uintptr_t cfa, bool exit_sigstack)
+replay_log (struct tramp_alloc_state *S, uintptr_t cfa)
 {
-  uintptr_t *log = G->cur_log;
-  unsigned int inuse = G->cur_log_inuse;
+  size_t end = S->cur_log_inuse;
+  size_t cut;
+
+  /* Most calls come from a frame newer than any in the log.  */
+  if (end > 0 && entry_older_p (S->cur_log, end - 2, end, cfa))
+    return;
+
+  cut = find_cut (S->cur_log, 0, end, cfa);
+  if (cut < end)
+    cut_log (S, cut);
+}
+
+
+/* Append an entry to the log.  */
+
+static inline void
+push_log (struct tramp_alloc_state *S, uintptr_t action, uintptr_t data)
+{
+  size_t inuse = S->cur_log_inuse;
+
+  if (__builtin_expect (inuse == S->cur_log_committed, 0))
+    grow_log (S);
 
-  while (inuse > 0)
+  S->cur_log[inuse++] = action;
+  S->cur_log[inuse++] = data;
+  S->cur_log_inuse = inuse;
+  if (inuse > S->cur_log_hwm)
+    S->cur_log_hwm = inuse;
+}
+
+/* Add a log entry, before the trampolines it records are counted.  */
+
+static void
+add_log (struct tramp_alloc_state *S, uintptr_t action, uintptr_t data)
+{
+  uintptr_t *log = S->cur_log;
+  size_t inuse = S->cur_log_inuse;
+
+  if (action > LOG_CHECKPOINT && inuse > 0 && log[inuse - 2] == action)
     {
-      uintptr_t action = log[inuse - 2];
-      uintptr_t data = log[inuse - 1];
+      log[inuse - 1] += data;
+      return;
+    }
+
+  if (inuse % LOG_STRIDE == 0)
+    push_log (S, LOG_CHECKPOINT, S->total);
+  push_log (S, action, data);
+}
+
+/* Count N more trampolines for the frame of CUR_CFA, whose entry is
+   most often the last.  */
+
+static inline void
+add_log_more (struct tramp_alloc_state *S, uintptr_t n)
+{
+  size_t inuse = S->cur_log_inuse;
+
+  if (__builtin_expect (inuse > 0
+			&& S->cur_log[inuse - 2] == S->cur_cfa, 1))
+    S->cur_log[inuse - 1] += n;
+  else
+    add_log (S, S->cur_cfa, n);
+}
+
+/* Start a new page pair for S, linked to the current one.  */
+
+static void
+new_page (struct tramp_alloc_state *S)
+{
+  void *page = alloc_one_tramp_page (S);
+
+  *page_link (page) = S->cur_page;
+  S->cur_page = page;
+  S->cur_page_inuse = TRAMP_RESERVE;
+}
+
+/* Take one trampoline from S for the frame at CFA, or for the same frame
+   as last time if CFA is 0.  Any replay has been done.  */
+
+static inline void *
+take_tramp (struct tramp_alloc_state *S, uintptr_t cfa,
+	    uintptr_t fnaddr, uintptr_t chain_value)
+{
+  void *tramp_code;
+  uintptr_t *tramp_data;
+  unsigned int index;
+
+  /* If needed, allocate a new tramp page pair.  */
+  if (S->cur_page_inuse >= PAGE_LINK)
+    new_page (S);
+
+  /* Add, or update, the log entry for the number of trampolines
+     allocated by the current function frame.  */
+  if (cfa)
+    {
+      S->cur_cfa = cfa;
+      add_log (S, cfa, 1);
+    }
+  else
+    add_log_more (S, 1);
+
+  index = S->cur_page_inuse++;
+  S->total++;
+  STACK_STAT_ADD (S, stack_live, 1);
+
+  tramp_code = S->cur_page + index * TRAMP_SIZE;
+  tramp_data = tramp_code + __tramp_data_offset;
+
+  tramp_data[TRAMP_FUNCADDR_FIRST ? 0 : 1] = fnaddr;
+  tramp_data[TRAMP_FUNCADDR_FIRST ? 1 : 0] = chain_value;
+
+  return tramp_code;
+}
+
+/* Likewise N trampolines, filled from FNS and CHAINS and stored in OUT,
+   as a run within each page pair.  */
+
+static void
+take_tramps (struct tramp_alloc_state *S, uintptr_t cfa, size_t n,
+	     const uintptr_t *fns, const uintptr_t *chains, void **out)
+{
+  void *tramp_code;
+  uintptr_t *tramp_data;
+  unsigned int index, count;
+  size_t i;
+
+  if (cfa)
+    {
+      S->cur_cfa = cfa;
+      add_log (S, cfa, n);
+    }
+  else
+    add_log_more (S, n);
+
+  S->total += n;
+  STACK_STAT_ADD (S, stack_live, n);
+
+  while (n > 0)
+    {
+      /* If needed, allocate a new tramp page pair.  */
+      if (S->cur_page_inuse >= PAGE_LINK)
+	new_page (S);
+
+      count = PAGE_LINK - S->cur_page_inuse;
+      if (count > n)
+	count = n;
+
+      index = S->cur_page_inuse;
+      S->cur_page_inuse += count;
+
+      for (i = 0; i < count; ++i)
+	{
+	  tramp_code = S->cur_page + (index + i) * TRAMP_SIZE;
+	  tramp_data = tramp_code + __tramp_data_offset;
+
+	  tramp_data[TRAMP_FUNCADDR_FIRST ? 0 : 1] = fns[i];
+	  tramp_data[TRAMP_FUNCADDR_FIRST ? 1 : 0] = chains[i];
+	  out[i] = tramp_code;
+	}
+
+      fns += count;
+      chains += count;
+      out += count;
+      n -= count;
+    }
+}
+
+/* Finish marking G busy, once handlers that arrive will keep to
+   NESTED_STATE.  A call that is abandoned may have updated a state's
+   total but not yet the stack_live count, or the reverse, so note what
+   both were; owner_gone puts the count right from these and the logs.  */
+
+static inline void
+mark_busy (struct tramp_globals *G)
+{
+  struct tramp_ctx *ctx = G->ctx ? G->ctx : &G->thread_ctx;
+
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+  G->busy_live = __tramp_stats ()->stack_live;
+  G->busy_ctx_total = ctx->state.total;
+  G->busy_signal_total = G->signal_state.total;
+}
+
+/* Allocate for a signal handler that interrupted __tramp_stack_alloc.
+   This is done with signals blocked, so can't itself be interrupted.
+   A handler that interrupted an earlier call has since returned, so
+   everything allocated for it is released; within one call, nothing
+   is.  */
+
+static void __attribute__((noinline))
+nested_alloc (struct tramp_globals *G, uintptr_t cfa, size_t n,
+	      const uintptr_t *fns, const uintptr_t *chains, void **out)
+{
+  struct tramp_alloc_state *S = &G->nested_state;
+  sigset_t old_set;
+
+  block_signals (&old_set);
+  if (G->nested_epoch != G->epoch)
+    {
+      if (S->cur_log)
+	replay_log (S, -1);
+      G->nested_epoch = G->epoch;
+    }
+  take_tramps (S, cfa, n, fns, chains, out);
+  G->refill = true;
+  unblock_signals (&old_set);
+}
+
+/* Release what handlers allocated from NESTED_STATE, which have all
+   returned by the time the thread enters a frame outside of one, so
+   that it holds nothing between them.  */
+
+static void __attribute__((noinline))
+release_nested (struct tramp_globals *G)
+{
+  sigset_t old_set;
+
+  block_signals (&old_set);
+  replay_log (&G->nested_state, -1);
+  unblock_signals (&old_set);
+}
+
+
+/* Frames are ordered by stack segment first, and by address within a
+   segment.  The thread's own stack is at depth 0, and each segment
+   entered from a frame at depth D is at depth D + 1.  The log records
+   each frame by a key that folds both together: the segment at depth D
+   maps its addresses into the SEG_WINDOW bytes just below
+   SEG_KEY_TOP - D * SEG_WINDOW, so that keys compare as the stack
+   grows down.  Frames on the signal stack, or on any stack we don't
+   know, are keyed by their plain CFA; those of the signal stack are
+   only compared with each other.
+
+   Segments other than the thread's stack are registered with
+   __tramp_register_stack, or found through __splitstack_find when the
+   program uses -fsplit-stack.  They are kept in a table sorted by
+   address, and the one that held the last frame is cached in
+   STACK_LO, STACK_HI and STACK_BIAS.  */
+/* ??? A segment larger than SEG_WINDOW, which can happen only for the
+   thread's own stack, shares its deepest keys with the next depth.  */
+
+#define SEG_KEY_TOP	((uintptr_t) -2)
+#define SEG_WINDOW	((uintptr_t) 1 << (sizeof (uintptr_t) == 8 ? 40 : 25))
+#define SEG_MAX_DEPTH	(SEG_KEY_TOP / SEG_WINDOW - 1)
+
+struct tramp_stack_seg
+{
+  uintptr_t lo, hi, bias;
+  unsigned int depth;
+
+  /* True if found through __splitstack_find.  */
+  bool split;
+};
+
+extern void *__splitstack_find (void *, void *, size_t *, void **, void **,
+				void **) __attribute__((weak));
+
+static inline uintptr_t
+seg_bias (unsigned int depth, uintptr_t hi)
+{
+  return SEG_KEY_TOP - depth * SEG_WINDOW - hi;
+}
+
+/* Make the stack of the current context the cached segment.  Each is
+   at depth 0 in its own log.  */
+
+static inline void
+cache_ctx_seg (struct tramp_globals *G)
+{
+  G->stack_lo = G->ctx->stack_lo;
+  G->stack_hi = G->ctx->stack_hi;
+  G->stack_bias = G->ctx->stack_bias;
+}
+
+/* Widen the bounds of the current context, which were not given, to
+   take in ADDR, which sigaltstack says is not on the signal stack.
+   Return false if ADDR is too far from them, and so likely on some
+   other stack.  The first address seen fixes the bias, half a window
+   above it, so that keys made before and after stay in order.  */
+/* ??? A frame seen before its context learned anything is keyed by its
+   plain CFA, like one on an unknown stack.  */
+
+#define LEARN_GAP	((uintptr_t) 1 << 20)
+
+static bool __attribute__((noinline))
+learn_bounds (struct tramp_globals *G, uintptr_t addr)
+{
+  struct tramp_ctx *ctx = G->ctx;
+  uintptr_t lo = addr & -(uintptr_t) __tramp_page_size;
+  uintptr_t hi = lo + __tramp_page_size, top, ss_lo;
+  unsigned int i;
+
+  if (!ctx->learn)
+    return false;
+  if (ctx->stack_lo == ctx->stack_hi)
+    ctx->stack_bias = seg_bias (0, lo + SEG_WINDOW / 2);
+  else if (addr < ctx->stack_lo && ctx->stack_lo - lo <= LEARN_GAP)
+    hi = ctx->stack_hi;
+  else if (addr >= ctx->stack_hi && hi - ctx->stack_hi <= LEARN_GAP)
+    lo = ctx->stack_lo;
+  else
+    return false;
+
+  /* Keep within the window, and clear of the signal stack and of the
+     registered segments.  */
+  top = SEG_KEY_TOP - ctx->stack_bias;
+  if (hi - 1 > top || top - lo >= SEG_WINDOW)
+    return false;
+  ss_lo = (uintptr_t) G->cur_sigstack.ss_sp;
+  if (ss_lo < hi && lo < ss_lo + G->cur_sigstack.ss_size)
+    return false;
+  for (i = 0; i < G->nsegs; ++i)
+    if (G->segs[i].lo < hi && lo < G->segs[i].hi)
+      return false;
+
+  ctx->stack_lo = lo;
+  ctx->stack_hi = hi;
+  cache_ctx_seg (G);
+  return true;
+}
+
+/* The key whose destructor frees what each thread holds when it
+   exits, made when the library is loaded.  */
+
+static pthread_key_t thread_key;
+static bool thread_key_made;
+
+static void
+thread_exit (void *arg __attribute__((unused)))
+{
+  __tramp_stack_free_thread ();
+}
 
-      switch (action)
+/* Arrange for the thread's memory to be freed when it exits, and ask
+   for the bounds of its stack, unless that was done already.  Both may
+   allocate memory, so this is done only when the thread blocks no
+   signals, as it does not within a handler, which runs with at least
+   its own signal blocked.  If some bounds were learned already, the
+   real ones are taken only if they fit the same window of keys.
+   Return true if it has been done.  */
+/* ??? A handler installed with SA_NODEFER and an empty mask can't be
+   told apart from the thread.  A thread that always blocks some signal
+   goes on learning its bounds, and what it holds is freed at exit only
+   if it calls __tramp_stack_free_thread.  */
+
+static bool __attribute__((noinline))
+settle_thread (struct tramp_globals *G)
+{
+  struct tramp_ctx *ctx = &G->thread_ctx;
+  pthread_attr_t attr;
+  sigset_t old_set;
+  uintptr_t lo, hi, top;
+  void *addr;
+  size_t size;
+
+  if (G->settled)
+    return true;
+  if (pthread_sigmask (SIG_BLOCK, NULL, &old_set) != 0
+      || !sigisemptyset (&old_set))
+    return false;
+  G->settled = true;
+
+  block_signals (&old_set);
+  if (thread_key_made)
+    pthread_setspecific (thread_key, G);
+  if (ctx->learn && pthread_getattr_np (pthread_self (), &attr) == 0)
+    {
+      if (pthread_attr_getstack (&attr, &addr, &size) == 0)
 	{
-	case LOG_NEW_LOG:
-	  free_one_log_page (G, log);
-	  log = (uintptr_t *) data;
-	  inuse = LOG_SIZE;
-	  break;
-
-	case LOG_NEW_PAGE:
-	  assert (G->cur_page_inuse == TRAMP_RESERVE);
-	  free_one_tramp_page (G, G->cur_page);
-	  G->cur_page = (void *) data;
-	  G->cur_page_inuse = TRAMP_COUNT;
-	  break;
-
-	case LOG_SIGSTACK:
-	  if (!exit_sigstack)
-	    goto egress;
-	  exit_sigstack = false;
-	  break;
-
-	default:
-	  if (!exit_sigstack && cfa_older_p (action, cfa))
-	    goto egress;
-	  assert (G->cur_page_inuse >= data);
-	  G->cur_page_inuse -= data;
-	  break;
+	  lo = (uintptr_t) addr;
+	  hi = lo + size;
+	  if (ctx->stack_lo == ctx->stack_hi)
+	    ctx->stack_bias = seg_bias (0, hi);
+	  top = SEG_KEY_TOP - ctx->stack_bias;
+	  if (hi - 1 <= top && top - lo < SEG_WINDOW)
+	    {
+	      ctx->stack_lo = lo;
+	      ctx->stack_hi = hi;
+	      ctx->learn = false;
+	    }
 	}
+      pthread_attr_destroy (&attr);
+    }
+  unblock_signals (&old_set);
 
-      inuse -= 2;
+  if (G->ctx == ctx)
+    cache_ctx_seg (G);
+  return true;
+}
+
+/* Set up the thread's state the first time it is used: note its signal
+   stack if it has one yet, and unless they were found already, learn
+   the bounds of its stack from the frames seen until settle_thread can
+   ask for them.  This may run in a signal handler, so it makes only
+   async-signal-safe calls itself.  */
+
+static void __attribute__((noinline))
+init_stack_bounds (struct tramp_globals *G)
+{
+  sigset_t old_set;
+  stack_t ss;
+
+  if (G->thread_ctx.stack_lo == G->thread_ctx.stack_hi)
+    {
+      G->thread_ctx.stack_lo = G->thread_ctx.stack_hi = 1;
+      G->thread_ctx.stack_bias = 0;
+      G->thread_ctx.learn = true;
     }
 
- egress:
-  G->cur_log = log;
-  G->cur_log_inuse = inuse;
+  block_signals (&old_set);
+  if (sigaltstack (NULL, &ss) == 0 && !(ss.ss_flags & SS_DISABLE))
+    {
+      G->cur_sigstack = ss;
+      G->refill = !(ss.ss_flags & SS_ONSTACK);
+    }
+  unblock_signals (&old_set);
+
+  if (G->ctx == NULL)
+    G->ctx = &G->thread_ctx;
+  G->cur_state = &G->ctx->state;
+  cache_ctx_seg (G);
+  settle_thread (G);
 }
 
+/* Make the key, and find the stack of the thread loading the library,
+   while that is safe to do.  */
+
+static void __attribute__((constructor))
+stack_init (void)
+{
+  struct tramp_globals *G = get_globals ();
 
-/* Add a log entry.  */
+  if (pthread_key_create (&thread_key, thread_exit) != 0)
+    abort ();
+  thread_key_made = true;
+  if (G->stack_hi == 0)
+    init_stack_bounds (G);
+  else
+    settle_thread (G);
+}
+
+/* Fill the reserve of S with WANT page pairs, and commit enough of its
+   log to record as many trampolines one by one.  */
 
 static void
-add_log (struct tramp_globals *G, uintptr_t action, uintptr_t data)
+fill_reserve (struct tramp_alloc_state *S, unsigned int want)
 {
-  uintptr_t *log = G->cur_log;
-  unsigned int inuse = G->cur_log_inuse;
+  size_t n = (size_t) want * PAGE_TRAMPS;
+  size_t words = (n / (LOG_STRIDE / 2 - 1) + 1) * LOG_STRIDE;
+  sigset_t old_set;
+  void *page;
+
+  S->reserve_want = want;
+  if (S->nreserve >= want && S->cur_log_committed >= words)
+    return;
 
-  if (log == NULL || inuse == LOG_SIZE)
+  block_signals (&old_set);
+  while (S->nreserve < want)
     {
-      uintptr_t *new_log = alloc_one_log_page (G);
-      new_log[0] = LOG_NEW_LOG;
-      new_log[1] = (uintptr_t) log;
-      inuse = 2;
-      G->cur_log = log = new_log;
+      page = pool_get (pool_pairs, POOL_PAIRS, &pool_npairs);
+      if (page == NULL)
+	page = __tramp_alloc_pair ();
+      *page_link (page) = S->reserve;
+      S->reserve = page;
+      S->nreserve++;
     }
+  while (S->cur_log_committed < words)
+    grow_log (S);
+  unblock_signals (&old_set);
+}
+
+/* Fill the reserves of the signal and nested states, so that handlers
+   on the signal stack, and those that interrupt an allocation, find
+   what they need there.  This is done on the way into an allocation off
+   the signal stack, after the signal stack was first seen or last used.
+   Until there is one, sigaltstack is asked now and then, since a thread
+   may well set one up only after it starts allocating.
 
-  log[inuse++] = action;
-  log[inuse++] = data;
-  G->cur_log_inuse = inuse;
+   That allocation may itself be in a handler installed without
+   SA_ONSTACK, but then it is no worse off than when it needs a page
+   pair of its own: the page allocators block signals while they hold
+   a lock, and the rest is system calls.  */
+
+#define SIGSTACK_POLL	1024
+
+static void __attribute__((noinline))
+refill_reserve (struct tramp_globals *G)
+{
+  unsigned int want = __tramp_tunables.signal_pairs;
+  stack_t ss;
+
+  G->refill = false;
+  if (want == 0)
+    return;
+  if (G->cur_sigstack.ss_size == 0)
+    {
+      if (sigaltstack (NULL, &ss) != 0 || (ss.ss_flags & SS_DISABLE))
+	return;
+      G->cur_sigstack = ss;
+      G->cur_sigstack.ss_flags = 0;
+    }
+
+  fill_reserve (&G->signal_state, want);
+  fill_reserve (&G->nested_state, want);
 }
 
+/* Return the segment in the table of G holding ADDR, or null.  */
 
-/* Set CFA only for the first allocation in the function; subsequent
-   allocations use CFA=0.  */
+static struct tramp_stack_seg *
+find_seg (struct tramp_globals *G, uintptr_t addr)
+{
+  unsigned int lo = 0, hi = G->nsegs, mid;
 
-void *
-__tramp_stack_alloc (uintptr_t cfa, uintptr_t fnaddr, uintptr_t chain_value)
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      if (addr < G->segs[mid].lo)
+	hi = mid;
+      else if (addr >= G->segs[mid].hi)
+	lo = mid + 1;
+      else
+	return &G->segs[mid];
+    }
+  return NULL;
+}
+
+/* Return the segment table of G, creating it with the thread's own
+   stack as its first entry if need be.  The table is mapped directly,
+   since this may be reached from a signal handler.  */
+
+static struct tramp_stack_seg *
+seg_table (struct tramp_globals *G)
+{
+  void *p;
+
+  if (G->segs)
+    return G->segs;
+  if (G->stack_hi == 0)
+    init_stack_bounds (G);
+
+  p = mmap (NULL, __tramp_page_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+
+  G->segs = p;
+  G->maxsegs = __tramp_page_size / sizeof (struct tramp_stack_seg);
+  if (!G->thread_ctx.learn)
+    G->segs[G->nsegs++] = (struct tramp_stack_seg) {
+      G->thread_ctx.stack_lo, G->thread_ctx.stack_hi,
+      G->thread_ctx.stack_bias, 0, false
+    };
+  return G->segs;
+}
+
+/* Remove entry I from the table of G.  */
+
+static void
+remove_seg (struct tramp_globals *G, unsigned int i)
+{
+  G->nsegs--;
+  memmove (&G->segs[i], &G->segs[i + 1],
+	   (G->nsegs - i) * sizeof (struct tramp_stack_seg));
+}
+
+/* Add [LO, HI) at DEPTH to the table of G, which exists, in place of
+   any entries it overlaps.  Return false if the table is full.  */
+
+static bool
+insert_seg (struct tramp_globals *G, uintptr_t lo, uintptr_t hi,
+	    unsigned int depth, bool split)
+{
+  unsigned int i;
+
+  for (i = 0; i < G->nsegs; )
+    if (G->segs[i].lo < hi && lo < G->segs[i].hi)
+      remove_seg (G, i);
+    else
+      i++;
+  if (G->nsegs == G->maxsegs)
+    return false;
+
+  for (i = G->nsegs; i > 0 && G->segs[i - 1].lo > lo; --i)
+    G->segs[i] = G->segs[i - 1];
+  G->segs[i] = (struct tramp_stack_seg) {
+    lo, hi, seg_bias (depth, hi), depth, split
+  };
+  G->nsegs++;
+  cache_ctx_seg (G);
+  return true;
+}
+
+/* Bring the split stack segments in the table of G up to date, now
+   that a frame at CFA was not found in it.  */
+/* ??? libgcc tells us only the part of each segment in use, so the
+   newest one is widened as frames are found further down it.  */
+
+static void __attribute__((noinline))
+refresh_split (struct tramp_globals *G, uintptr_t cfa)
+{
+  struct { uintptr_t lo, hi; } found[64];
+  void *next_segment, *next_sp, *initial_sp, *sp;
+  struct tramp_stack_seg *seg;
+  unsigned int i, n = 0;
+  size_t len;
+
+  if (seg_table (G) == NULL)
+    return;
+
+  sp = __splitstack_find (NULL, NULL, &len, &next_segment, &next_sp,
+			  &initial_sp);
+  if (sp == NULL)
+    return;
+
+  /* Most often, we are just further down the newest segment.  */
+  seg = find_seg (G, (uintptr_t) sp + len - 1);
+  if (seg && seg->split && seg->hi == (uintptr_t) sp + len)
+    {
+      if (cfa < seg->lo && cfa > (uintptr_t) sp)
+	{
+	  seg->lo = (uintptr_t) sp;
+	  cache_ctx_seg (G);
+	}
+      return;
+    }
+
+  for (; sp != NULL && n < 64;
+       sp = __splitstack_find (next_segment, next_sp, &len, &next_segment,
+			       &next_sp, &initial_sp))
+    {
+      found[n].lo = (uintptr_t) sp;
+      found[n].hi = (uintptr_t) sp + len;
+      n++;
+    }
+
+  for (i = 0; i < G->nsegs; )
+    if (G->segs[i].split)
+      remove_seg (G, i);
+    else
+      i++;
+
+  /* The oldest is the thread's own stack, if we know where that is.  */
+  for (i = 0; i < n; ++i)
+    {
+      seg = find_seg (G, found[i].lo);
+      if (seg && !seg->split && seg->depth == 0)
+	continue;
+      insert_seg (G, found[i].lo, found[i].hi, n - 1 - i, true);
+    }
+}
+
+/* Return in *KEY the key for the frame at CFA, when that is not in the
+   cached segment.  Return false if no segment holds it.  */
+
+static bool __attribute__((noinline))
+find_key (struct tramp_globals *G, uintptr_t cfa, uintptr_t *key)
+{
+  struct tramp_stack_seg *seg = find_seg (G, cfa);
+
+  if (seg == NULL && __splitstack_find)
+    {
+      refresh_split (G, cfa);
+      seg = find_seg (G, cfa);
+    }
+  if (seg == NULL)
+    return false;
+
+  G->stack_lo = seg->lo;
+  G->stack_hi = seg->hi;
+  G->stack_bias = seg->bias;
+  *key = cfa + seg->bias;
+  return true;
+}
+
+static bool owner_gone (struct tramp_globals *, uintptr_t);
+
+/* Note that the thread is about to run on [LO, HI), entered from the
+   calling frame, which makes it one deeper than the segment holding
+   that.  */
+
+int
+__tramp_register_stack (void *lo, void *hi)
 {
   struct tramp_globals *G = get_globals ();
-  sigset_t old_set, full_set;
+  uintptr_t l = (uintptr_t) lo, h = (uintptr_t) hi;
+  struct tramp_stack_seg *seg;
+  uintptr_t sp = (uintptr_t) __builtin_frame_address (0);
+  unsigned int depth;
+  int ret = -1;
+
+  if (l >= h || h - l > SEG_WINDOW || (G->busy && !owner_gone (G, sp)))
+    return -1;
+  if (G->stack_hi == 0)
+    init_stack_bounds (G);
+
+  G->busy = 1;
+  G->busy_sp = sp;
+  mark_busy (G);
+
+  if (seg_table (G))
+    {
+      seg = find_seg (G, (uintptr_t) __builtin_frame_address (0));
+      depth = seg ? seg->depth + 1 : 1;
+      if (depth <= SEG_MAX_DEPTH && insert_seg (G, l, h, depth, false))
+	ret = 0;
+    }
 
-  sigfillset (&full_set);
-  pthread_sigmask (SIG_SETMASK, &full_set, &old_set);
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+  G->busy = 0;
+  return ret;
+}
 
-  if (cfa)
+int
+__tramp_unregister_stack (void *lo)
+{
+  struct tramp_globals *G = get_globals ();
+  struct tramp_stack_seg *seg;
+  uintptr_t sp = (uintptr_t) __builtin_frame_address (0);
+  int ret = -1;
+
+  if (G->busy && !owner_gone (G, sp))
+    return -1;
+
+  G->busy = 1;
+  G->busy_sp = sp;
+  mark_busy (G);
+
+  seg = find_seg (G, (uintptr_t) lo);
+  if (seg && seg->lo == (uintptr_t) lo && !seg->split && seg->depth > 0)
     {
-      stack_t ss;
+      remove_seg (G, seg - G->segs);
+      cache_ctx_seg (G);
+      ret = 0;
+    }
+
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+  G->busy = 0;
+  return ret;
+}
 
-      /* ??? Use glibc tcb entries in order to quickly determine that the cfa
-	 is indeed within the current thread's stack.  When this test fails,
-	 there are two possibilities: (1) we're on the signal stack, (2) we're
-	 using split stacks (which needs additional help in order to determine
-	 whether the current frame is inner or outer of the previous), or
-	 (3) the user is doing something odd with the stacks.  */
+/* Release what was allocated for frames that have since returned, now
+   that the frame at CFA is allocating, and choose the state it
+   allocates in.  Return the key for that frame.  */
 
-      sigaltstack (NULL, &ss);
-      if (__builtin_expect (ss.ss_flags == SS_ONSTACK, 0))
+static inline uintptr_t
+enter_frame (struct tramp_globals *G, uintptr_t cfa)
+{
+  struct tramp_alloc_state *S;
+  uintptr_t key = cfa;
+  stack_t ss;
+
+  if (__builtin_expect (G->nested_state.total != 0, 0))
+    release_nested (G);
+
+  /* A cfa within a known stack segment means we are not on the
+     signal stack, and one within the signal stack last seen means we
+     are, so no system call is needed to find that out.  Most often,
+     that is the segment of the last frame.  When these tests fail,
+     there are two possibilities: (1) we're on a new signal stack, or
+     (2) the user is doing something odd with the stacks.  */
+  /* ??? A signal stack carved out of the thread's own stack will not
+     be noticed.  */
+
+  if (__builtin_expect (G->stack_hi == 0, 0))
+    init_stack_bounds (G);
+  if (__builtin_expect (cfa - G->stack_lo < G->stack_hi - G->stack_lo, 1))
+    {
+      key = cfa + G->stack_bias;
+      ss.ss_flags = 0;
+    }
+  else if ((G->segs || __splitstack_find) && find_key (G, cfa, &key))
+    ss.ss_flags = 0;
+  else if (cfa - G->ctx->stack_lo < G->ctx->stack_hi - G->ctx->stack_lo)
+    {
+      cache_ctx_seg (G);
+      key = cfa + G->stack_bias;
+      ss.ss_flags = 0;
+    }
+  else if (cfa - (uintptr_t) G->cur_sigstack.ss_sp
+	   < G->cur_sigstack.ss_size)
+    {
+      ss = G->cur_sigstack;
+      ss.ss_flags = SS_ONSTACK;
+    }
+  else
+    {
+      /* Learn where the context's stack is, if need be, so that the
+	 next frame there need not ask again.  The thread's own stack
+	 is asked for whole, once that is safe.  */
+      if (!G->settled && settle_thread (G)
+	  && cfa - G->stack_lo < G->stack_hi - G->stack_lo)
 	{
-	  if (G->cur_sigstack.ss_flags == SS_ONSTACK)
-	    {
-	      uintptr_t replay_cfa = cfa;
-
-	      /* We are still running on the signal stack.  Double-check
-		 that it's the same stack, Just In Case.  */
-	      if (ss.ss_sp != G->cur_sigstack.ss_sp
-		  || ss.ss_size != G->cur_sigstack.ss_size)
-		{
-		  G->cur_sigstack = ss;
-		  replay_cfa = -1;
-		}
-
-	      replay_log (G, replay_cfa, false);
-	    }
-	  else
-	    {
-	      G->cur_sigstack = ss;
-	      add_log (G, LOG_SIGSTACK, 0);
-	    }
+	  key = cfa + G->stack_bias;
+	  ss.ss_flags = 0;
 	}
       else
 	{
-	  bool exit_sigstack = false;
-
-	  if (G->cur_sigstack.ss_flags == SS_ONSTACK)
-	    {
-	      G->cur_sigstack.ss_flags = 0;
-	      exit_sigstack = true;
-	    }
+	  sigaltstack (NULL, &ss);
+	  if (ss.ss_flags != SS_ONSTACK && learn_bounds (G, cfa))
+	    key = cfa + G->stack_bias;
+	}
+    }
 
-	  replay_log (G, cfa, exit_sigstack);
+  if (__builtin_expect (ss.ss_flags == SS_ONSTACK, 0))
+    {
+      /* Frames on the signal stack are keyed by their plain CFA, and
+	 only ever compared with each other.  Double-check that it's the
+	 same stack, Just In Case.  */
+      S = &G->signal_state;
+      if (ss.ss_sp != G->cur_sigstack.ss_sp
+	  || ss.ss_size != G->cur_sigstack.ss_size)
+	{
+	  G->cur_sigstack = ss;
+	  replay_log (S, -1);
+	}
+      G->cur_sigstack.ss_flags = SS_ONSTACK;
+      G->refill = true;
+    }
+  else
+    {
+      /* Whatever the handlers allocated on the signal stack is gone
+	 once we are back off it.  */
+      S = &G->ctx->state;
+      if (G->cur_sigstack.ss_flags == SS_ONSTACK)
+	{
+	  G->cur_sigstack.ss_flags = 0;
+	  replay_log (&G->signal_state, -1);
 	}
+      if (__builtin_expect (G->refill
+			    || (G->cur_sigstack.ss_size == 0
+				&& ++G->sigstack_poll % SIGSTACK_POLL == 0),
+			    0))
+	refill_reserve (G);
+    }
 
-      G->cur_cfa = cfa;
+  replay_log (S, key);
+  G->cur_state = S;
+  return key;
+}
+
+/* Release what was allocated for frames no older than the one at ADDR,
+   and make the newest frame left the current one.  */
+
+static void __attribute__((noinline))
+release_to (struct tramp_globals *G, uintptr_t addr)
+{
+  struct tramp_alloc_state *S;
+  size_t p;
+
+  enter_frame (G, addr);
+
+  S = G->cur_state;
+  p = S->cur_log_inuse;
+  if (p > 0 && S->cur_log[p - 2] == LOG_CHECKPOINT)
+    p -= 2;
+  if (p > 0 && S->cur_log[p - 2] > LOG_CHECKPOINT)
+    S->cur_cfa = S->cur_log[p - 2];
+}
+
+/* A later allocation for the frame that last gave its CFA.  If a
+   signal handler allocated since, its frames are gone by now, but it
+   took over CUR_STATE or its CUR_CFA.  Release what the handler had,
+   which is anything no older than our own frame, and go back to the
+   frame before it.  */
+/* ??? A handler whose frames were above the stack pointer the caller
+   has now, such as after an alloca, is not noticed.  */
+
+static inline void
+resume_frame (struct tramp_globals *G)
+{
+  uintptr_t sp = (uintptr_t) __builtin_frame_address (0);
+
+  if (__builtin_expect (sp - G->stack_lo < G->stack_hi - G->stack_lo
+			&& G->cur_sigstack.ss_flags != SS_ONSTACK
+			&& cfa_older_p (G->cur_state->cur_cfa,
+					sp + G->stack_bias), 1))
+    return;
+  release_to (G, sp);
+}
+
+/* Count the trampolines of S again from its log, and make its chain
+   of page pairs match, after a call that was updating it was abandoned
+   at some arbitrary point.  Return the count.  */
+
+static uintptr_t
+repair_state (struct tramp_alloc_state *S)
+{
+  uintptr_t *log = S->cur_log;
+  size_t p = S->cur_log_inuse;
+  uintptr_t total = 0, pages = 0, keep;
+  void *page;
+
+  if (p > 0)
+    total = total_at (log, p - 2)
+	    + (log[p - 2] > LOG_CHECKPOINT ? log[p - 1] : 0);
+  for (page = S->cur_page; page != NULL; page = *page_link (page))
+    pages++;
+
+  keep = (total + PAGE_TRAMPS - 1) / PAGE_TRAMPS;
+  if (pages > keep)
+    free_pages (S, pages - keep);
+  for (; pages < keep; ++pages)
+    new_page (S);
+
+  if (keep)
+    S->cur_page_inuse = TRAMP_RESERVE + total - (keep - 1) * PAGE_TRAMPS;
+  else
+    S->cur_page_inuse = TRAMP_COUNT;
+  S->total = total;
+  return total;
+}
+
+/* Return true if the thread is busy only because a signal handler
+   jumped out of the call that marked it so, and put things right for
+   the call whose frame is at SP.  A handler that truly interrupted that
+   call runs below its frame, or on the signal stack, while we are back
+   at or above it on the same stack, or off the signal stack that it
+   was using.  */
+/* ??? A jump out of __tramp_register_stack or __tramp_unregister_stack
+   may leave the segment table half moved, and is not repaired.  */
+
+static bool __attribute__((noinline))
+owner_gone (struct tramp_globals *G, uintptr_t sp)
+{
+  uintptr_t owner = G->busy_sp;
+  uintptr_t lo = G->stack_lo, size = G->stack_hi - lo;
+  uintptr_t ss_lo = (uintptr_t) G->cur_sigstack.ss_sp;
+  uintptr_t ss_size = G->cur_sigstack.ss_size;
+
+  if (owner - ss_lo < ss_size)
+    {
+      if (sp - ss_lo < ss_size && sp < owner)
+	return false;
     }
+  else if (!(sp - lo < size && owner - lo < size && sp >= owner))
+    return false;
+
+  /* The thread is still busy, so a handler that arrives meanwhile
+     keeps to NESTED_STATE.  */
+  cache_ctx_seg (G);
+  __tramp_stats ()->stack_live
+    = (G->busy_live
+       + (repair_state (&G->ctx->state) - G->busy_ctx_total)
+       + (repair_state (&G->signal_state) - G->busy_signal_total));
+  G->cur_state = &G->ctx->state;
+  release_to (G, sp);
+  return true;
+}
 
-  /* If needed, allocate a new tramp page pair.  */
-  if (G->cur_page_inuse == TRAMP_COUNT)
+/* Set CFA only for the first allocation in the function; subsequent
+   allocations use CFA=0.
+
+   Rather than block signals, which would cost two system calls each
+   time, mark the thread busy while updating its state.  A signal
+   handler that calls in meanwhile sees that, and allocates from
+   NESTED_STATE instead.  The signal fences keep the compiler from
+   moving the updates outside the marks.  A handler that longjmps out
+   of an interrupted call leaves the thread marked busy, which the next
+   call notices from where its own frame is.  */
+
+void *
+__tramp_stack_alloc (uintptr_t cfa, uintptr_t fnaddr, uintptr_t chain_value)
+{
+  struct tramp_globals *G = get_globals ();
+  uintptr_t sp = (uintptr_t) __builtin_frame_address (0);
+  void *ret;
+
+  if (__builtin_expect (G->busy, 0) && !owner_gone (G, sp))
     {
-      add_log (G, LOG_NEW_PAGE, (uintptr_t) G->cur_page);
-      G->cur_page = alloc_one_tramp_page (G);
-      G->cur_page_inuse = TRAMP_RESERVE;
+      nested_alloc (G, cfa, 1, &fnaddr, &chain_value, &ret);
+      return ret;
+    }
+
+  G->busy = 1;
+  G->busy_sp = sp;
+  G->epoch++;
+  mark_busy (G);
+
+  if (cfa)
+    cfa = enter_frame (G, cfa);
+  else
+    resume_frame (G);
+  ret = take_tramp (G->cur_state, cfa, fnaddr, chain_value);
+
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+  G->busy = 0;
+
+  return ret;
+}
 
-      /* Force a new log entry for the current function frame.  */
-      cfa = G->cur_cfa;
+/* Likewise for N trampolines at once, as a run within each page pair.  */
+
+void
+__tramp_stack_alloc_n (uintptr_t cfa, size_t n, const uintptr_t *fns,
+		       const uintptr_t *chains, void **out)
+{
+  struct tramp_globals *G = get_globals ();
+  uintptr_t sp = (uintptr_t) __builtin_frame_address (0);
+
+  if (n == 0)
+    return;
+  if (__builtin_expect (G->busy, 0) && !owner_gone (G, sp))
+    {
+      nested_alloc (G, cfa, n, fns, chains, out);
+      return;
     }
 
-  /* Add, or update, the log entry for the number of trampolines
-     allocated by the current function frame.  */
+  G->busy = 1;
+  G->busy_sp = sp;
+  G->epoch++;
+  mark_busy (G);
+
   if (cfa)
-    add_log (G, cfa, 1);
+    cfa = enter_frame (G, cfa);
+  else
+    resume_frame (G);
+  take_tramps (G->cur_state, cfa, n, fns, chains, out);
+
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+  G->busy = 0;
+}
+
+/* Release what frames at CFA and newer allocated now, rather than when
+   an older frame next allocates.  A signal handler that interrupted an
+   allocation can't, and releases nothing.  */
+
+void
+__tramp_stack_release (uintptr_t cfa)
+{
+  struct tramp_globals *G = get_globals ();
+  uintptr_t sp = (uintptr_t) __builtin_frame_address (0);
+
+  if (G->cur_state == NULL || G->cur_state->cur_log == NULL
+      || (G->busy && !owner_gone (G, sp)))
+    return;
+
+  G->busy = 1;
+  G->busy_sp = sp;
+  G->epoch++;
+  mark_busy (G);
+
+  release_to (G, cfa);
+
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+  G->busy = 0;
+}
+
+/* For an unwinder, release what the frame of CONTEXT and those newer
+   allocated.  The personality routine does just that, for frames with
+   nothing else to clean up.  */
+
+void
+__tramp_stack_unwind (struct _Unwind_Context *context)
+{
+  __tramp_stack_release (_Unwind_GetCFA (context));
+}
+
+_Unwind_Reason_Code
+__tramp_personality (int version, _Unwind_Action actions,
+		     _Unwind_Exception_Class exception_class
+		       __attribute__((unused)),
+		     struct _Unwind_Exception *exception __attribute__((unused)),
+		     struct _Unwind_Context *context)
+{
+  if (version == 1 && (actions & _UA_CLEANUP_PHASE))
+    __tramp_stack_unwind (context);
+  return _URC_CONTINUE_UNWIND;
+}
+
+/* Release everything in S, leaving its log and page pairs in the pool
+   for whoever comes next.  */
+
+static void
+free_state (struct tramp_alloc_state *S)
+{
+  void *page;
+
+  if (S->cur_log)
+    {
+      replay_log (S, -1);
+      if (S->cur_log_reserved == LOG_WORDS (LOG_SLOT))
+	put_log_slot (S->cur_log);
+      else
+	{
+	  S->cur_log[0] = S->cur_log_committed;
+	  if (!pool_put (pool_logs, POOL_LOGS, &pool_nlogs, S->cur_log))
+	    __tramp_release_log (S->cur_log, LOG_RESERVE,
+				 S->cur_log_committed * sizeof (uintptr_t));
+	}
+    }
+  if (S->save_page
+      && !pool_put (pool_pairs, POOL_PAIRS, &pool_npairs, S->save_page))
+    __tramp_free_pair (S->save_page);
+  while ((page = S->reserve) != NULL)
+    {
+      S->reserve = *page_link (page);
+      if (!pool_put (pool_pairs, POOL_PAIRS, &pool_npairs, page))
+	__tramp_free_pair (page);
+    }
+  S->cur_log = NULL;
+  S->cur_log_inuse = S->cur_log_committed = S->cur_log_hwm = 0;
+  S->cur_log_reserved = 0;
+  S->save_page = NULL;
+  S->nreserve = S->reserve_want = 0;
+}
+
+/* Contexts for fibers, each with its own stack from LO to HI, which
+   may both be null if unknown, and are then learned from the frames
+   seen.  Switching just changes which context the thread allocates in,
+   and a fiber's trampolines all go when it is destroyed.  */
+
+struct tramp_ctx *
+__tramp_ctx_create (void *lo, void *hi)
+{
+  struct tramp_ctx *ctx = calloc (1, sizeof (*ctx));
+
+  if (ctx == NULL)
+    return NULL;
+  ctx->state.cur_page_inuse = UINT_MAX;
+  ctx->state.cur_log = get_log_slot ();
+  if (ctx->state.cur_log)
+    ctx->state.cur_log_committed = ctx->state.cur_log_reserved
+      = LOG_WORDS (LOG_SLOT);
+  if (lo && hi)
+    {
+      ctx->stack_lo = (uintptr_t) lo;
+      ctx->stack_hi = (uintptr_t) hi;
+      ctx->stack_bias = seg_bias (0, ctx->stack_hi);
+    }
   else
     {
-      assert (G->cur_log[G->cur_log_inuse - 2] == G->cur_cfa);
-      G->cur_log[G->cur_log_inuse - 1] += 1;
+      ctx->stack_lo = ctx->stack_hi = 1;
+      ctx->learn = true;
     }
+  return ctx;
+}
+
+/* Make CTX, or the thread's own if null, the context to allocate in,
+   and store the one that was in *OLD, again null for the thread's own.
+   Call just before switching stacks.  A handler that interrupted an
+   allocation can't switch from under it, and gets -1.  */
+
+int
+__tramp_ctx_switch (struct tramp_ctx *ctx, struct tramp_ctx **old)
+{
+  struct tramp_globals *G = get_globals ();
+  uintptr_t sp = (uintptr_t) __builtin_frame_address (0);
+  struct tramp_ctx *prev;
+
+  if (G->stack_hi == 0)
+    init_stack_bounds (G);
+  if (ctx == NULL)
+    ctx = &G->thread_ctx;
+  if (G->busy && !owner_gone (G, sp))
+    return -1;
 
-  {
-    void *tramp_code, *page;
-    uintptr_t *tramp_data;
-    unsigned int index;
+  G->busy = 1;
+  G->busy_sp = sp;
+  mark_busy (G);
 
-    page = G->cur_page;
-    index = G->cur_page_inuse++;
+  prev = G->ctx;
+  G->ctx = ctx;
+  if (G->cur_state == &prev->state)
+    G->cur_state = &ctx->state;
+  cache_ctx_seg (G);
 
-    tramp_code = page + index * TRAMP_SIZE;
-    tramp_data = tramp_code + PAGE_SIZE;
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+  G->busy = 0;
 
-    tramp_data[TRAMP_FUNCADDR_FIRST ? 0 : 1] = fnaddr;
-    tramp_data[TRAMP_FUNCADDR_FIRST ? 1 : 0] = chain_value;
+  if (old)
+    *old = (prev == &G->thread_ctx ? NULL : prev);
+  return 0;
+}
 
-    pthread_sigmask (SIG_SETMASK, &old_set, NULL);
+/* Free CTX and everything allocated in it.  If it is the current
+   context, the thread's own becomes current.  */
 
-    return tramp_code;
-  }
+void
+__tramp_ctx_destroy (struct tramp_ctx *ctx)
+{
+  struct tramp_globals *G = get_globals ();
+
+  if (G->ctx == ctx && __tramp_ctx_switch (NULL, NULL) != 0)
+    abort ();
+  free_state (&ctx->state);
+  free (ctx);
 }
 
-void /* __attribute__((thread_destructor)) */
+/* Release everything the thread holds.  This runs by itself when a
+   thread that has allocated exits, but may be called earlier.  Its
+   fibers' contexts are left to __tramp_ctx_destroy.  */
+
+void
 __tramp_stack_free_thread (void)
 {
   struct tramp_globals *G = get_globals ();
 
-  if (G->cur_log)
-    replay_log (G, -1, true);
-  if (G->save_log)
-    free_one_log_page_raw (G->save_log);
-  if (G->save_page)
-    __tramp_free_pair (G->save_page);
+  free_state (&G->thread_ctx.state);
+  free_state (&G->signal_state);
+  free_state (&G->nested_state);
+  if (G->segs)
+    munmap (G->segs, __tramp_page_size);
+  G->segs = NULL;
+  G->nsegs = 0;
+  G->stack_hi = 0;
+  G->settled = false;
 }
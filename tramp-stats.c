@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "tramp.h"
+
+
+__thread struct tramp_thread_stats __tramp_thread_stats;
+struct tramp_stats __tramp_stats_retired;
+
+/* The threads with counters of their own.  LOCK covers the list and the
+   folding of an exiting thread's counters into __tramp_stats_retired.
+   Signals are blocked while it is held, since a handler that counts
+   something may need it to register its thread.  */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tramp_thread_stats *thread_list;
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+#define NFIELDS	(sizeof (struct tramp_stats) / sizeof (unsigned long))
+
+/* Add the counters in FROM to TO.  Another thread may be updating FROM,
+   which is fine for a statistic so long as each word is read whole.  */
+
+static void
+add_stats (struct tramp_stats *to, struct tramp_stats *from)
+{
+  unsigned long *t = (unsigned long *) to;
+  unsigned long *f = (unsigned long *) from;
+  size_t i;
+
+  for (i = 0; i < NFIELDS; ++i)
+    t[i] += __atomic_load_n (&f[i], __ATOMIC_RELAXED);
+}
+
+static void
+lock_stats (sigset_t *old_set)
+{
+  sigset_t full_set;
+
+  sigfillset (&full_set);
+  pthread_sigmask (SIG_SETMASK, &full_set, old_set);
+  pthread_mutex_lock (&lock);
+}
+
+static void
+unlock_stats (sigset_t *old_set)
+{
+  pthread_mutex_unlock (&lock);
+  pthread_sigmask (SIG_SETMASK, old_set, NULL);
+}
+
+static void
+thread_destructor (void *arg)
+{
+  struct tramp_thread_stats *t = arg;
+  unsigned long *r = (unsigned long *) &__tramp_stats_retired;
+  unsigned long *f = (unsigned long *) &t->s;
+  sigset_t old_set;
+  size_t i;
+
+  lock_stats (&old_set);
+  for (i = 0; i < NFIELDS; ++i)
+    {
+      __atomic_fetch_add (&r[i], f[i], __ATOMIC_RELAXED);
+      f[i] = 0;
+    }
+  if (t->next)
+    t->next->prev = t->prev;
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    thread_list = t->next;
+  t->registered = false;
+  unlock_stats (&old_set);
+}
+
+static void
+thread_key_init (void)
+{
+  if (pthread_key_create (&thread_key, thread_destructor) != 0)
+    abort ();
+}
+
+/* Create the key at load time, so that a handler registering its
+   thread finds it done.  */
+
+static void __attribute__((constructor))
+stats_init (void)
+{
+  pthread_once (&thread_once, thread_key_init);
+}
+
+/* Link T into the list, the first time its thread counts anything.
+   A thread may come back here from the destructors of other keys, once
+   its own has run; the key is then set again, and the counters folded
+   in on the next round of destructors.  Signals are blocked meanwhile,
+   since a handler calling __tramp_stack_alloc would come back here.  */
+
+void
+__tramp_stats_register (struct tramp_thread_stats *t)
+{
+  sigset_t old_set, full_set;
+
+  sigfillset (&full_set);
+  pthread_sigmask (SIG_SETMASK, &full_set, &old_set);
+  if (t->registered)
+    goto out;
+
+  pthread_once (&thread_once, thread_key_init);
+
+  pthread_mutex_lock (&lock);
+  t->prev = NULL;
+  t->next = thread_list;
+  if (t->next)
+    t->next->prev = t;
+  thread_list = t;
+  t->registered = true;
+  pthread_mutex_unlock (&lock);
+
+  pthread_setspecific (thread_key, t);
+ out:
+  pthread_sigmask (SIG_SETMASK, &old_set, NULL);
+}
+
+void
+__tramp_get_stats (struct tramp_stats *stats)
+{
+  struct tramp_thread_stats *t;
+  sigset_t old_set;
+
+  memset (stats, 0, sizeof (*stats));
+
+  lock_stats (&old_set);
+  add_stats (stats, &__tramp_stats_retired);
+  for (t = thread_list; t != NULL; t = t->next)
+    add_stats (stats, &t->s);
+  unlock_stats (&old_set);
+}
@@ -0,0 +1,60 @@
+#define _GNU_SOURCE
+#include <string.h>
+
+#include "tramp.h"
+
+
+/* Tunables are read once from the environment, in the style of
+   GLIBC_TUNABLES:
+
+	TRAMP_TUNABLES=name=value:name=value...
+
+   Unknown names and malformed values are ignored, so that a setting
+   meant for a newer library does not break an older one.  */
+
+struct tramp_tunables __tramp_tunables = {
+  .heap_keep_empty = 4,
+  .signal_pairs = 2,
+};
+
+static const struct
+{
+  const char *name;
+  unsigned long *value;
+} tunable_list[] = {
+  { "hugepages", &__tramp_tunables.hugepages },
+  { "prewarm_pairs", &__tramp_tunables.prewarm_pairs },
+  { "heap_lockfree", &__tramp_tunables.heap_lockfree },
+  { "heap_keep_empty", &__tramp_tunables.heap_keep_empty },
+  { "refill_pairs", &__tramp_tunables.refill_pairs },
+  { "signal_pairs", &__tramp_tunables.signal_pairs },
+};
+
+void
+__tramp_tunables_init (void)
+{
+  const char *p = getenv ("TRAMP_TUNABLES");
+
+  while (p != NULL && *p != '\0')
+    {
+      const char *eq = strchr (p, '=');
+      const char *end = strchr (p, ':');
+      size_t i;
+
+      if (end == NULL)
+	end = p + strlen (p);
+      if (eq != NULL && eq < end)
+	for (i = 0; i < sizeof (tunable_list) / sizeof (tunable_list[0]); ++i)
+	  if (strlen (tunable_list[i].name) == (size_t) (eq - p)
+	      && memcmp (tunable_list[i].name, p, eq - p) == 0)
+	    {
+	      char *tail;
+	      unsigned long v = strtoul (eq + 1, &tail, 0);
+	      if (tail == end && tail != eq + 1)
+		*tunable_list[i].value = v;
+	      break;
+	    }
+
+      p = (*end == ':' ? end + 1 : end);
+    }
+}
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <unwind.h>
 
 #include "tramp-cpu.h"
 
@@ -15,19 +16,240 @@
 # define TRAMP_FUNCADDR_FIRST 1
 #endif
 
-#define TRAMP_COUNT		(PAGE_SIZE / TRAMP_SIZE - TRAMP_RESERVE)
+/* PAGE_SIZE from the cpu header is the largest page size supported.
+   Ports whose kernels may be configured with smaller pages list every
+   size with TRAMP_PAGE_SIZES (X), and the one matching the running
+   kernel is chosen at load time.  This relies on TRAMP_RESERVE being 0,
+   so that the first N bytes of a template are a template for N-byte
+   pages.  */
+#ifndef TRAMP_PAGE_SIZES
+# define TRAMP_PAGE_SIZES(X)	X (PAGE_SIZE)
+# define TRAMP_MIN_PAGE_SIZE	PAGE_SIZE
+#endif
+
+#define TRAMP_COUNT		(__tramp_page_size / TRAMP_SIZE - TRAMP_RESERVE)
+
+/* The cpu header provides TRAMP_ASM_STRING_N (NAME, DIST), which emits
+   one PAGE_SIZE page of trampolines labeled NAME, each of which loads
+   its data from DIST bytes beyond itself.  The classic page pair has
+   its data on the very next page.  */
+#define TRAMP_STR_1(X)		#X
+#define TRAMP_STR(X)		TRAMP_STR_1(X)
+
+/* The size of the code pages mapped at once from the template source,
+   in units of PAGE_SIZE.  The data pages follow as a block, so each of
+   the code pages has its data TRAMP_SLAB_PAGES * PAGE_SIZE bytes away.
+   The ports set this only as large as their load displacements can
+   reach.  */
+#ifndef TRAMP_SLAB_PAGES
+# define TRAMP_SLAB_PAGES	1
+#endif
+
+/* A port whose displacements reach that far may also define
+   TRAMP_HUGE_SIZE, the huge page size, in which case slabs of one huge
+   code page and one huge data page are available on request.  */
+
+/* Counters reported by __tramp_get_stats.  */
+struct tramp_stats
+{
+  /* Trampolines currently allocated.  */
+  unsigned long heap_live;
+  unsigned long stack_live;
+
+  /* Page pairs currently held by the heap, including empty ones kept.  */
+  unsigned long heap_pages;
+
+  /* Page pairs currently mapped, in use or not, and pages committed to
+     stack allocator logs.  */
+  unsigned long pairs_mapped;
+  unsigned long log_pages_mapped;
+
+  /* System calls made to map and unmap them.  */
+  unsigned long mmap_calls;
+  unsigned long munmap_calls;
+
+  /* Page pairs wanted by the stack allocator, and how many of those
+     its per-thread save_page supplied.  */
+  unsigned long save_page_lookups, save_page_hits;
+
+  /* Stack allocator log entries replayed.  */
+  unsigned long replay_entries;
+
+  /* Calls to __tramp_heap_intern, and how many of those found the
+     trampoline already interned.  */
+  unsigned long intern_lookups, intern_hits;
+
+  /* Acquisitions of the heap lock, how many of those had to wait, and
+     for how long in total, in nanoseconds.  */
+  unsigned long lock_acquires, lock_waits, lock_wait_ns;
+};
 
 #pragma GCC visibility push(hidden)
 
 extern void* __tramp_alloc_pair (void);
 extern void __tramp_free_pair (void *page);
 
+/* Free N page pairs at once, starting with PAGE, each linked to the
+   next by the pointer LINK bytes into it.  */
+extern void __tramp_free_pairs (void *page, size_t link, size_t n);
+
+/* Map fresh page pairs without taking any lock.  Return the first code
+   page and store the number of pairs in *COUNT; the rest follow at
+   page size intervals.  These can't be given to __tramp_free_pair.  */
+extern void *__tramp_map_pairs (unsigned int *count);
+
+/* Like __tramp_free_pair, but if the pair stays mapped, give the memory
+   of its data page back to the system now.  */
+extern void __tramp_purge_pair (void *page);
+
+/* Page pairs are kept on separate lists for each NUMA node, and their
+   data pages bound to it.  Nodes past the limit share lists.  */
+#define TRAMP_MAX_NODES	16
+
+/* The node of the calling thread, which is also that of the pairs
+   __tramp_alloc_pair returns to it.  */
+extern unsigned int __tramp_node (void);
+
+/* The stack allocator's log: reserve SIZE bytes of address space, or
+   return null if that can't be done, make LEN bytes at P of it usable,
+   and release it with COMMITTED bytes made usable.  */
+extern void *__tramp_reserve_log (size_t size);
+extern void __tramp_commit_log (void *p, size_t len);
+extern void __tramp_release_log (void *p, size_t size, size_t committed);
+
+/* The page size of the running kernel.  */
+extern size_t __tramp_page_size;
+
+/* The distance from a trampoline to its data.  Valid once the first
+   page pair has been allocated.  */
+extern size_t __tramp_data_offset;
+
+/* Settings from the TRAMP_TUNABLES environment variable.  */
+struct tramp_tunables
+{
+  /* Nonzero to map trampolines from huge page arenas.  */
+  unsigned long hugepages;
+
+  /* The number of page pairs to map and prefault when the library is
+     loaded, and to keep in reserve thereafter.  */
+  unsigned long prewarm_pairs;
+
+  /* Nonzero for a heap that takes no locks, so that it is safe to use
+     from signal handlers, at the cost of never unmapping its pages.  */
+  unsigned long heap_lockfree;
+
+  /* The number of empty heap pages to keep before releasing some.  */
+  unsigned long heap_keep_empty;
+
+  /* Nonzero to have a service thread keep this many page pairs ready
+     for each node, and free released pairs in the background.  */
+  unsigned long refill_pairs;
+
+  /* The number of page pairs each thread with a signal stack keeps for
+     handlers that run on it, and as many again for handlers that
+     interrupt an allocation.  */
+  unsigned long signal_pairs;
+};
+
+extern struct tramp_tunables __tramp_tunables;
+extern void __tramp_tunables_init (void);
+
+/* Counters for the hot paths are kept per thread, and summed only when
+   asked for.  Each thread's are linked into a list when it first
+   counts something, and folded into __tramp_stats_retired when it
+   exits.  Counters for the slow paths, and for any code that may run
+   in a signal handler, are updated atomically in __tramp_stats_retired
+   directly.  */
+struct tramp_thread_stats
+{
+  struct tramp_stats s;
+  struct tramp_thread_stats *prev, *next;
+  bool registered;
+};
+
+extern __thread struct tramp_thread_stats __tramp_thread_stats;
+extern struct tramp_stats __tramp_stats_retired;
+extern void __tramp_stats_register (struct tramp_thread_stats *);
+
+static inline struct tramp_stats *
+__tramp_stats (void)
+{
+  struct tramp_thread_stats *t = &__tramp_thread_stats;
+
+  if (__builtin_expect (!t->registered, 0))
+    __tramp_stats_register (t);
+  return &t->s;
+}
+
+#define TRAMP_STAT_ADD(FIELD, N) \
+  __atomic_fetch_add (&__tramp_stats_retired.FIELD, (N), __ATOMIC_RELAXED)
+
+/* The number of interned heap trampolines, and a function to drop a
+   reference to TRAMP if it is one of them.  That returns false if the
+   caller should go on to free TRAMP.  */
+extern unsigned long __tramp_intern_count;
+extern bool __tramp_intern_put (void *tramp);
+
 #pragma GCC visibility pop
 
 extern void *__tramp_stack_alloc (uintptr_t cfa, uintptr_t, uintptr_t);
+
+/* Allocate N stack trampolines for the frame at CFA in one call.  */
+extern void __tramp_stack_alloc_n (uintptr_t cfa, size_t n,
+				   const uintptr_t *fns,
+				   const uintptr_t *chains, void **out);
+
+/* Release the stack trampolines of the frame at CFA and every newer
+   one at once, as after a longjmp past them.  __tramp_stack_unwind does
+   the same for the frame an unwinder is at, and __tramp_personality is
+   a personality routine that does nothing else.  */
+extern void __tramp_stack_release (uintptr_t cfa);
+extern void __tramp_stack_unwind (struct _Unwind_Context *context);
+extern _Unwind_Reason_Code
+__tramp_personality (int version, _Unwind_Action actions,
+		     _Unwind_Exception_Class exception_class,
+		     struct _Unwind_Exception *exception,
+		     struct _Unwind_Context *context);
+
+/* Contexts for fibers that run on stacks of their own, between LO and
+   HI, each with stack trampolines of its own.  Switch to a fiber's
+   context, or to the thread's own with null, just before switching to
+   its stack; the previous context is stored in *OLD unless that is
+   null.  Switching returns 0, or -1 without switching when called from
+   a signal handler that interrupted an allocation.  Destroying a context
+   frees all of its trampolines.  */
+struct tramp_ctx;
+extern struct tramp_ctx *__tramp_ctx_create (void *lo, void *hi);
+extern int __tramp_ctx_switch (struct tramp_ctx *ctx, struct tramp_ctx **old);
+extern void __tramp_ctx_destroy (struct tramp_ctx *ctx);
+
+/* Free the stack trampolines of the calling thread, which happens by
+   itself when it exits.  */
 extern void __tramp_stack_free_thread (void);
 
+/* Note that the calling thread is about to switch to the stack [LO, HI)
+   from the current frame, or that the stack at LO is gone, so that the
+   stack allocator orders the frames on it correctly.  Both return 0 on
+   success, and -1 if the stack can't be recorded or wasn't.  */
+extern int __tramp_register_stack (void *lo, void *hi);
+extern int __tramp_unregister_stack (void *lo);
+
 extern void *__tramp_heap_alloc (uintptr_t fn, uintptr_t chain);
 extern void __tramp_heap_free (void *tramp);
 
+/* Allocate or free N heap trampolines in one call.  */
+extern void __tramp_heap_alloc_n (size_t n, const uintptr_t *fns,
+				  const uintptr_t *chains, void **out);
+extern void __tramp_heap_free_n (size_t n, void *const *tramps);
+
+/* Return a heap trampoline shared with every other caller asking for
+   the same FN and CHAIN.  Each must still call __tramp_heap_free, and
+   the trampoline is freed only with the last.  */
+extern void *__tramp_heap_intern (uintptr_t fn, uintptr_t chain);
+
+/* Release all but KEEP empty heap pages.  */
+extern int __tramp_heap_trim (size_t keep);
+
+extern void __tramp_get_stats (struct tramp_stats *stats);
+
 #endif /* GCC_TRAMP_H */